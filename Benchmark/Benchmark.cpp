@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <span>
+#include <string>
+#include <vector>
+#include "../Bloat/Bloater.h"
+#include "../Bloat/Obfuscator.h"
+#include "../Bloat/SplitMix64.h"
+#include "../Bloat/Stream.h"
+#include "../Bloat/Xorshift64Star.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BLOAT_BENCHMARK_RDTSC 1
+#endif
+
+namespace fs = std::filesystem;
+
+// Measures the throughput of the kernels BLOAT spends its time in. Every benchmark is run a few times, keeping the
+// fastest run, and reported in bytes per second and (on x86, where the time stamp counter is available) cycles per byte.
+// Note that the TSC ticks at a constant rate, so cycles/byte is only accurate if the CPU doesn't boost or throttle.
+class Benchmark
+{
+private:
+	static constexpr inline const int RUNS = 5;
+
+	// Keeps the compiler from optimizing away results that are never used
+	static inline volatile uint64_t sink = 0;
+
+	struct Sample
+	{
+		double seconds;
+		uint64_t cycles;
+	};
+
+	static inline uint64_t ReadCycleCounter() noexcept
+	{
+#if BLOAT_BENCHMARK_RDTSC
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	// Runs the body RUNS times and returns the fastest run. The setup is invoked before every run and isn't timed.
+	template<typename Setup, typename Body>
+	static inline Sample Measure(Setup&& setup, Body&& body)
+	{
+		Sample best{ std::numeric_limits<double>::max(), 0 };
+
+		for (int run = 0; run < RUNS; run++)
+		{
+			setup();
+
+			const auto start = std::chrono::steady_clock::now();
+			const uint64_t startCycles = ReadCycleCounter();
+
+			body();
+
+			const uint64_t endCycles = ReadCycleCounter();
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			if (seconds < best.seconds)
+				best = { seconds, endCycles - startCycles };
+		}
+
+		return best;
+	}
+
+	template<typename Body>
+	static inline Sample Measure(Body&& body) { return Measure([]() { }, body); }
+
+	static inline std::string FormatSize(const uint64_t size)
+	{
+		if (size >= 1024 * 1024 && size % (1024 * 1024) == 0)
+			return std::to_string(size / (1024 * 1024)) + " MiB";
+
+		if (size >= 1024 && size % 1024 == 0)
+			return std::to_string(size / 1024) + " KiB";
+
+		return std::to_string(size) + " B";
+	}
+
+	static inline void Report(const std::string& name, const std::string& parameters, const uint64_t numBytes, const Sample& sample)
+	{
+		const double bytesPerSecond = sample.seconds > 0.0 ? numBytes / sample.seconds : 0.0;
+
+		std::cout << std::left << std::setw(34) << name << std::setw(24) << parameters << std::right << std::fixed
+			<< std::setw(14) << std::setprecision(1) << bytesPerSecond / (1024.0 * 1024.0) << " MiB/s"
+			<< std::setw(18) << std::setprecision(0) << bytesPerSecond << " B/s";
+
+#if BLOAT_BENCHMARK_RDTSC
+		std::cout << std::setw(10) << std::setprecision(3) << static_cast<double>(sample.cycles) / numBytes << " cycles/B";
+#else
+		std::cout << std::setw(10) << "n/a" << " cycles/B";
+#endif
+
+		std::cout << "\n";
+	}
+
+	static inline std::vector<unsigned char> CreateRandomBytes(const size_t size)
+	{
+		std::vector<unsigned char> bytes(size);
+		Xorshift64Star random{ UINT64_C(0x1234567890ABCDEF) };
+
+		for (unsigned char& byte : bytes)
+			byte = static_cast<unsigned char>(random.NextUInt64());
+
+		return bytes;
+	}
+
+public:
+	static inline void BloaterBloat(const size_t size, const uint64_t multiplier)
+	{
+		const std::vector<unsigned char> original = CreateRandomBytes(size);
+		std::vector<unsigned char> bytes{};
+		bytes.reserve(size * multiplier);  // So that only the copying is measured, not the allocation
+
+		const Sample sample = Measure([&]() { bytes.assign(original.begin(), original.end()); }, [&]() { Bloater::Bloat(bytes, multiplier); });
+		Report("Bloater::Bloat", FormatSize(size) + " x" + std::to_string(multiplier), size * multiplier, sample);
+	}
+
+	// Debloating only truncates the buffer, so this mostly shows that it doesn't depend on the size of the data.
+	static inline void BloaterDebloat(const size_t size, const uint64_t multiplier)
+	{
+		std::vector<unsigned char> bloated = CreateRandomBytes(size);
+		Bloater::Bloat(bloated, multiplier);
+
+		std::vector<unsigned char> bytes{};
+		bytes.reserve(bloated.size());
+
+		const Sample sample = Measure([&]() { bytes.assign(bloated.begin(), bloated.end()); }, [&]() { Bloater::Debloat(bytes, multiplier); });
+		Report("Bloater::Debloat", FormatSize(size) + " x" + std::to_string(multiplier), size * multiplier, sample);
+	}
+
+	static inline void RandomXorObfuscate(const size_t size)
+	{
+		std::vector<unsigned char> bytes = CreateRandomBytes(size);
+
+		RandomXorObfuscator obfuscator{};
+		obfuscator.SetKey(UINT64_C(0x9E3779B97F4A7C15));
+
+		const Sample sample = Measure([&]() { obfuscator.Obfuscate(bytes); });
+		sink = sink + bytes[size / 2];
+
+		Report("RandomXorObfuscator::Obfuscate", FormatSize(size), size, sample);
+	}
+
+	static inline void Xorshift64StarNext(const uint64_t count)
+	{
+		Xorshift64Star random{ UINT64_C(0x1234567890ABCDEF) };
+
+		const Sample sample = Measure([&]()
+		{
+			uint64_t sum = 0;
+
+			for (uint64_t i = 0; i < count; i++)
+				sum += random.NextUInt64();
+
+			sink = sink + sum;
+		});
+
+		Report("Xorshift64Star::NextUInt64", std::to_string(count) + " calls", count * sizeof(uint64_t), sample);
+	}
+
+	static inline void SplitMix64Hash(const size_t size)
+	{
+		const std::vector<unsigned char> bytes = CreateRandomBytes(size);
+
+		const Sample sample = Measure([&]() { sink = sink + SplitMix64::ComputeHash(bytes); });
+		Report("SplitMix64::ComputeHash", FormatSize(size), size, sample);
+	}
+
+	static inline void FileStreamWrite(const fs::path& path, const size_t size, const size_t bufferSize, const size_t writeSize)
+	{
+		const std::vector<unsigned char> bytes = CreateRandomBytes(writeSize);
+
+		const Sample sample = Measure([&]()
+		{
+			FileStream stream = FileStream::OpenWrite(path, true, bufferSize);
+
+			for (size_t written = 0; written < size; written += writeSize)
+				stream.WriteBytes(std::span(bytes).first(std::min(writeSize, size - written)));
+
+			stream.Close();
+		});
+
+		Report("FileStream write", "buf " + FormatSize(bufferSize) + ", " + FormatSize(writeSize) + " writes", size, sample);
+	}
+
+	static inline void FileStreamRead(const fs::path& path, const size_t size, const size_t bufferSize, const size_t readSize)
+	{
+		const Sample sample = Measure([&]()
+		{
+			FileStream stream = FileStream::OpenRead(path, bufferSize);
+			uint64_t sum = 0;
+
+			stream.ReadChunks(size, [&sum](const std::span<const unsigned char> chunk) { sum += chunk.front(); }, readSize);
+			sink = sink + sum;
+		});
+
+		Report("FileStream read", "buf " + FormatSize(bufferSize) + ", " + FormatSize(readSize) + " reads", size, sample);
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	std::ios::sync_with_stdio(false);
+
+	// An optional argument overrides the amount of data (in MiB) every benchmark processes
+	const size_t size = (argc > 1 ? std::max(std::strtoull(argv[1], nullptr, 10), 1ull) : 64ull) * 1024 * 1024;
+
+#if !BLOAT_BENCHMARK_RDTSC
+	std::cout << "The cycle counter isn't available on this platform, so cycles/byte won't be reported.\n";
+#endif
+
+	std::cout << "Processing " << size / (1024 * 1024) << " MiB per benchmark, best of several runs:\n\n";
+
+	for (const uint64_t multiplier : { UINT64_C(2), UINT64_C(4), UINT64_C(16) })
+		Benchmark::BloaterBloat(size / multiplier, multiplier);
+
+	for (const uint64_t multiplier : { UINT64_C(2), UINT64_C(4), UINT64_C(16) })
+		Benchmark::BloaterDebloat(size / multiplier, multiplier);
+
+	for (const size_t obfuscatedSize : { size_t{ 4 * 1024 }, size_t{ 1024 * 1024 }, size })
+		Benchmark::RandomXorObfuscate(obfuscatedSize);
+
+	Benchmark::Xorshift64StarNext(size / sizeof(uint64_t));
+	Benchmark::SplitMix64Hash(size);
+
+	const fs::path path = fs::temp_directory_path() / ("bloat_benchmark_" + std::to_string(Xorshift64Star().GetState()) + ".tmp");
+
+	try
+	{
+		for (const size_t bufferSize : { size_t{ 64 * 1024 }, size_t{ 1024 * 1024 }, size_t{ 8 * 1024 * 1024 } })
+		{
+			for (const size_t ioSize : { size_t{ 4 * 1024 }, size_t{ 1024 * 1024 } })
+				Benchmark::FileStreamWrite(path, size, bufferSize, ioSize);
+		}
+
+		for (const size_t bufferSize : { size_t{ 64 * 1024 }, size_t{ 1024 * 1024 }, size_t{ 8 * 1024 * 1024 } })
+		{
+			for (const size_t ioSize : { size_t{ 4 * 1024 }, size_t{ 1024 * 1024 } })
+				Benchmark::FileStreamRead(path, size, bufferSize, ioSize);
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "An error occurred while benchmarking FileStream: " << ex.what() << "\n";
+
+		fs::remove(path);
+		return 1;
+	}
+
+	fs::remove(path);
+	return 0;
+}
\ No newline at end of file
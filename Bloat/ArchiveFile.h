@@ -1,79 +1,405 @@
 #pragma once
 #include <filesystem>
 #include <fstream>
+#include <optional>
 #include <vector>
 #include <ranges>
 #include "Stream.h"
 #include "Bloater.h"
+#include "Exceptions.h"
+#include "FileTable.h"
+#include "MappedFile.h"
+#include "Rescrambler.h"
 #include "Scrambler.h"
+#include "SplitMix64.h"
 
 namespace fs = std::filesystem;
 
-enum class ArchiveFileType
+enum class ArchiveFileType : uint8_t
 {
 	InternalFile, ExternalFile
 };
 
+// Kept small, as there's one for every file in the archive: the paths, the archive and the scrambler live in the file
+// table, which must outlive the file.
 class ArchiveFile
 {
 private:
-	const ArchiveFileType fileType;
+	const FileTable* table;
 
-	const fs::path actualPath;  // For external files only
-	const fs::path relativePath;
+	// The relative path in the arena of the table, in its generic form. The actual path of an external file follows it.
+	uint64_t pathOffset{};
+	uint32_t pathLength{};
+	uint32_t actualPathLength{};
 
-	const std::shared_ptr<Scrambler> scrambler;
+	uint64_t dataStartOffset{};  // For internal files only
+	uint64_t dataLength{};  // For external files, this is their (unscrambled) size at the time they were added
+
+	// For external files only. Along with the size, tells whether the file has changed since it was added.
+	fs::file_time_type lastWriteTime{};
+
+	// The hash of the unscrambled bytes. Comes from the file table of version 2+ archives, otherwise it's computed
+	// (once) when needed.
+	mutable uint64_t hash{};
+	mutable bool isHashKnown = false;
+
+	ArchiveFileType fileType;
 	bool isRemoved = false;
 
-	// For internal files only
-	const fs::path archivePath;
+	inline fs::path GetActualPath() const
+	{
+		return fs::path(table->GetPath(pathOffset + pathLength, actualPathLength));
+	}
+
+	// How much of each file is held in memory at once when comparing the contents of two files
+	static constexpr inline const uint64_t COMPARISON_WINDOW_SIZE = 16 * FileStream::CHUNK_SIZE;
+
+	// Opens an external file, making sure it's still the way it was when it was added.
+	inline FileStream OpenExternalFile() const
+	{
+		const fs::path& actualPath = GetActualPath();
+		auto fileStream = FileStream::OpenRead(actualPath);
+
+		// Its size has been taken for granted since it was added (e.g. to preallocate the archive)
+		if (fileStream.GetFile().GetSize() != dataLength || fs::last_write_time(actualPath) != lastWriteTime)
+		{
+			throw InvalidOperationException(
+				"The file \"" + GetPath().generic_string() + "\" has been modified since it was added to the archive."
+			);
+		}
+
+		return fileStream;
+	}
+
+	inline void ThrowIfNotDebloatable() const
+	{
+		if (dataLength % GetScrambler()->GetBloatMultiplier() != 0)
+			throw std::invalid_argument("The passed bytes cannot be debloated. The data is either corrupted or was bloated using a different bloat multiplier.");
+	}
 
-	const uint64_t dataStartOffset{};
-	const uint64_t dataLength{};
+	// Streams a range of the stored (scrambled) bytes of an internal file to the consumer, straight out of the mapping
+	// if there is one.
+	inline void ReadStoredChunks(const uint64_t offset, const uint64_t length, const ChunkConsumer& consume) const
+	{
+		if (const auto& view = GetStoredView())
+		{
+			const auto& bytes = view->subspan(static_cast<size_t>(offset), static_cast<size_t>(length));
+
+			for (size_t position = 0; position < bytes.size(); position += FileStream::CHUNK_SIZE)
+				consume(bytes.subspan(position, std::min<size_t>(bytes.size() - position, FileStream::CHUNK_SIZE)));
+
+			return;
+		}
+
+		auto archiveStream = FileStream::OpenRead(table->GetArchivePath());
+
+		archiveStream.SetReadPosition(dataStartOffset + offset);
+		archiveStream.ReadChunks(length, consume);
+	}
 
 public:
-	// For external files
-	inline ArchiveFile(const fs::path& actualPath, const fs::path& relativePath, const std::shared_ptr<Scrambler>& scrambler) noexcept
-		: fileType(ArchiveFileType::ExternalFile), actualPath(actualPath), relativePath(relativePath), scrambler(scrambler) { }
+	// For external files, with the size and last write time they have right now. Their paths are added to the table.
+	inline ArchiveFile(FileTable& table, const fs::path& actualPath, const fs::path& relativePath, const uint64_t size,
+		const fs::file_time_type lastWriteTime)
+		: table(&table), dataLength(size), lastWriteTime(lastWriteTime), fileType(ArchiveFileType::ExternalFile)
+	{
+		const PathRef relative = table.AddPath(relativePath.generic_u8string());
+		const PathRef actual = table.AddPath(actualPath.u8string());
 
-	// For internal files
-	inline ArchiveFile(
-		const fs::path& relativePath, const std::shared_ptr<Scrambler>& scrambler,
-		const fs::path& archivePath, const uint64_t dataStartOffset, const uint64_t dataLength
-	) noexcept
-		: fileType(ArchiveFileType::InternalFile), relativePath(relativePath), scrambler(scrambler),
-		archivePath(archivePath), dataStartOffset(dataStartOffset), dataLength(dataLength) { }
+		pathOffset = relative.offset;
+		pathLength = relative.length;
+		actualPathLength = actual.length;
+	}
+
+	// For internal files, whose path has already been added to the table
+	inline ArchiveFile(const FileTable& table, const PathRef path, const uint64_t dataStartOffset, const uint64_t dataLength,
+		const std::optional<uint64_t> hash = std::nullopt) noexcept
+		: table(&table), pathOffset(path.offset), pathLength(path.length), dataStartOffset(dataStartOffset), dataLength(dataLength),
+		hash(hash.value_or(UINT64_C(0))), isHashKnown(hash.has_value()), fileType(ArchiveFileType::InternalFile) { }
+
+	inline fs::path GetPath() const { return fs::path(GetPathString()); }
+
+	// Gets the relative path in its generic form, without constructing a path. Only valid until another file is added.
+	inline std::u8string_view GetPathString() const noexcept { return table->GetPath(pathOffset, pathLength); }
 
-	inline const fs::path& GetPath() const noexcept { return relativePath; }
+	inline bool IsInternal() const noexcept { return fileType == ArchiveFileType::InternalFile; }
+	inline const std::shared_ptr<Scrambler>& GetScrambler() const noexcept { return table->GetScrambler(); }
+
+	// For internal files only
+	inline uint64_t GetDataOffset() const noexcept { return dataStartOffset; }
+
+	// Gets a view of the stored (scrambled) bytes of an internal file if the archive has been mapped into memory.
+	inline std::optional<std::span<const unsigned char>> GetStoredView() const
+	{
+		const auto& mapping = table->GetMapping();
+
+		if (!mapping)
+			return std::nullopt;
+
+		const auto& bytes = mapping->GetBytes();
+
+		if (dataStartOffset > bytes.size() || dataLength > bytes.size() - dataStartOffset)
+			throw std::out_of_range("The data of the file lies outside the archive.");
+
+		return bytes.subspan(static_cast<size_t>(dataStartOffset), static_cast<size_t>(dataLength));
+	}
 
 	// In bytes
 	inline uint64_t GetUnscrambledSize() const
 	{
 		return fileType == ArchiveFileType::InternalFile ?
-			dataLength / scrambler->GetBloatMultiplier() : fs::file_size(actualPath);
+			dataLength / GetScrambler()->GetBloatMultiplier() : dataLength;
 	}
 
 	// In bytes
 	inline uint64_t GetScrambledSize() const
 	{
 		return fileType == ArchiveFileType::InternalFile ?
-			dataLength : fs::file_size(actualPath) * scrambler->GetBloatMultiplier();
+			dataLength : dataLength * GetScrambler()->GetBloatMultiplier();
 	}
 
-	inline std::vector<unsigned char> GetBytes() const
+	// Streams the unscrambled bytes of this file to the consumer chunk by chunk.
+	inline void ReadChunks(const ChunkConsumer& consume) const
 	{
 		if (fileType == ArchiveFileType::InternalFile)
 		{
-			auto archiveStream = FileStream::OpenRead(archivePath);
-			archiveStream.SetReadPosition(dataStartOffset);
+			// Every replica holds the same data, so reading the first one is enough
+			GetScrambler()->Unscramble([this](const ChunkConsumer& consumeScrambled)
+			{
+				ReadStoredChunks(0, GetUnscrambledSize(), consumeScrambled);
+			}, dataLength, consume);
+
+			return;
+		}
+
+		auto fileStream = OpenExternalFile();
+		fileStream.ReadChunks(dataLength, consume);
+	}
+
+	// Streams a range of the unscrambled bytes of this file to the consumer chunk by chunk. The range must lie within
+	// the file.
+	inline void ReadChunks(const uint64_t offset, const uint64_t length, const ChunkConsumer& consume) const
+	{
+		if (fileType == ArchiveFileType::InternalFile)
+		{
+			ThrowIfNotDebloatable();
+
+			// The first replica is where the keystream starts, so the range is at the same offset in both
+			const auto cursor = GetScrambler()->GetObfuscator()->CreateCursor();
+			cursor->Seek(offset);
+
+			std::vector<unsigned char> buffer{};
+
+			ReadStoredChunks(offset, length, [&cursor, &buffer, &consume](const std::span<const unsigned char> chunk)
+			{
+				buffer.resize(chunk.size());
+				cursor->Apply(chunk, buffer);
+
+				consume(buffer);
+			});
+
+			return;
+		}
+
+		auto fileStream = OpenExternalFile();
+
+		fileStream.SetReadPosition(offset);
+		fileStream.ReadChunks(length, consume);
+	}
+
+	// Compares the unscrambled bytes of both files, which may be of either type.
+	inline bool HasSameContent(const ArchiveFile& other) const
+	{
+		const uint64_t size = GetUnscrambledSize();
+
+		if (other.GetUnscrambledSize() != size)
+			return false;
+
+		std::vector<unsigned char> bytes{}, otherBytes{};
+
+		for (uint64_t position = 0; position < size; position += COMPARISON_WINDOW_SIZE)
+		{
+			const uint64_t length = std::min(size - position, COMPARISON_WINDOW_SIZE);
+
+			bytes.clear();
+			otherBytes.clear();
+
+			ReadChunks(position, length, [&bytes](const std::span<const unsigned char> chunk) { bytes.insert(bytes.end(), chunk.begin(), chunk.end()); });
+			other.ReadChunks(position, length, [&otherBytes](const std::span<const unsigned char> chunk) { otherBytes.insert(otherBytes.end(), chunk.begin(), chunk.end()); });
+
+			if (bytes != otherBytes)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Streams the bytes of this file, scrambled by the specified scrambler, to the consumer chunk by chunk.
+	inline void ReadScrambledChunks(const Scrambler& target, const ChunkConsumer& consume) const
+	{
+		if (GetUnscrambledSize() > FileStream::CHUNK_SIZE)
+		{
+			// Re-read the file for every replica instead of holding it in memory
+			target.Scramble([this](const ChunkConsumer& consumeUnscrambled) { ReadChunks(consumeUnscrambled); }, consume);
+			return;
+		}
+
+		const auto& bytes = GetBytes();  // Small enough to read only once
+		target.Scramble([&bytes](const ChunkConsumer& consumeUnscrambled) { consumeUnscrambled(bytes); }, consume);
+	}
+
+	// Checks whether every replica of this file still unscrambles to the same bytes as the first one, which is the only
+	// one read otherwise. Always true for external files.
+	inline bool AreReplicasIntact() const
+	{
+		if (fileType != ArchiveFileType::InternalFile)
+			return true;
+
+		const Scrambler& scrambler = *GetScrambler();
+		const uint64_t bloatMultiplier = scrambler.GetBloatMultiplier();
+
+		if (bloatMultiplier <= 1)
+			return true;
+
+		const uint64_t replicaSize = GetUnscrambledSize();
+
+		const auto& view = GetStoredView();
+		std::optional<FileStream> archiveStream{};
+
+		if (!view)
+			archiveStream = FileStream::OpenRead(table->GetArchivePath());
+
+		const auto& readStored = [&view, &archiveStream, this](const uint64_t offset, const std::span<unsigned char> buffer)
+		{
+			if (view)
+			{
+				std::memcpy(buffer.data(), view->data() + offset, buffer.size());
+				return;
+			}
 
-			auto bytes = archiveStream.ReadBytes(dataLength);
-			scrambler->Unscramble(bytes);
+			archiveStream->SetReadPosition(dataStartOffset + offset);
+			archiveStream->ReadBytes(buffer);
+		};
 
-			return bytes;
+		// One cursor per replica so that each keeps its place in the keystream between chunks
+		std::vector<std::unique_ptr<ObfuscationCursor>> cursors{};
+		cursors.reserve(bloatMultiplier);
+
+		for (uint64_t run = 0; run < bloatMultiplier; run++)
+		{
+			cursors.emplace_back(scrambler.GetObfuscator()->CreateCursor());
+			cursors.back()->Seek(run * replicaSize);
 		}
 
-		return FileStream::OpenRead(actualPath).ReadAllBytes();  // External file
+		std::vector<unsigned char> first{}, other{};
+
+		for (uint64_t position = 0; position < replicaSize; position += first.size())
+		{
+			const size_t chunkSize = static_cast<size_t>(std::min<uint64_t>(replicaSize - position, FileStream::CHUNK_SIZE));
+
+			first.resize(chunkSize);
+			other.resize(chunkSize);
+
+			readStored(position, first);
+			cursors[0]->Apply(first);
+
+			for (uint64_t run = 1; run < bloatMultiplier; run++)
+			{
+				readStored(run * replicaSize + position, other);
+				cursors[run]->Apply(other);
+
+				if (first != other)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Streams the bytes of an internal file, converted from its scrambler to the specified one, to the consumer chunk by
+	// chunk. Only the first stored replica is read, and the bytes are never fully unscrambled in between.
+	inline void ReadRescrambledChunks(const Scrambler& target, const ChunkConsumer& consume) const
+	{
+		const uint64_t replicaSize = GetUnscrambledSize();
+
+		if (replicaSize > FileStream::CHUNK_SIZE)
+		{
+			// Re-read the replica for every target replica instead of holding it in memory
+			for (uint64_t replica = 0; replica < target.GetBloatMultiplier(); replica++)
+				ReadRescrambledReplica(target, replica, consume);
+
+			return;
+		}
+
+		ThrowIfNotDebloatable();
+
+		if (const auto& view = GetStoredView())
+		{
+			Rescrambler(*GetScrambler(), target).Rescramble(view->first(static_cast<size_t>(replicaSize)), consume);
+			return;
+		}
+
+		std::vector<unsigned char> replica(static_cast<size_t>(replicaSize));  // Small enough to read only once
+
+		auto archiveStream = FileStream::OpenRead(table->GetArchivePath());
+		archiveStream.SetReadPosition(dataStartOffset);
+		archiveStream.ReadBytes(replica);
+
+		Rescrambler(*GetScrambler(), target).Rescramble(replica, consume);
+	}
+
+	// Like ReadRescrambledChunks(), but only streams the specified target replica.
+	inline void ReadRescrambledReplica(const Scrambler& target, const uint64_t replica, const ChunkConsumer& consume) const
+	{
+		ThrowIfNotDebloatable();
+
+		const uint64_t replicaSize = GetUnscrambledSize();
+
+		Rescrambler(*GetScrambler(), target).RescrambleReplica(replica, replicaSize, [this, replicaSize](const ChunkConsumer& consumeSource)
+		{
+			ReadStoredChunks(0, replicaSize, consumeSource);
+		}, consume);
+	}
+
+	// Streams the bytes of an internal file as they're stored in the archive (i.e. scrambled) to the consumer chunk by chunk.
+	inline void ReadRawChunks(const ChunkConsumer& consume) const
+	{
+		ReadStoredChunks(0, dataLength, consume);
+	}
+
+	inline std::vector<unsigned char> GetBytes() const
+	{
+		std::vector<unsigned char> bytes{};
+		bytes.reserve(GetUnscrambledSize());
+
+		ReadChunks([&bytes](const std::span<const unsigned char> chunk) { bytes.insert(bytes.end(), chunk.begin(), chunk.end()); });
+		return bytes;
+	}
+
+	// Reads the whole file and hashes its unscrambled bytes, ignoring the known hash.
+	inline uint64_t CalculateHash() const
+	{
+		SplitMix64::Hasher hasher{};
+		ReadChunks([&hasher](const std::span<const unsigned char> chunk) { hasher.Update(chunk); });
+
+		return hasher.GetHash();
+	}
+
+	// Gets the hash of the unscrambled bytes, only reading the file if the hash isn't known yet.
+	inline uint64_t GetHash() const
+	{
+		if (!isHashKnown)
+			SetKnownHash(CalculateHash());
+
+		return hash;
+	}
+
+	inline std::optional<uint64_t> GetKnownHash() const noexcept { return isHashKnown ? std::optional<uint64_t>(hash) : std::nullopt; }
+
+	inline void SetKnownHash(const uint64_t hash) const noexcept
+	{
+		this->hash = hash;
+		isHashKnown = true;
 	}
 
 	inline bool IsRemoved() const noexcept { return isRemoved; }
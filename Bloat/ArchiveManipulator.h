@@ -1,5 +1,6 @@
 #pragma once
 #include <filesystem>
+#include <format>
 #include "BloatArchive.h"
 #include "CmdArgsParser.h"
 #include "Utils.h"
@@ -13,6 +14,9 @@ private:
 	std::string password;
 
 	bool verifyChecksum = true;
+	size_t threadCount = Parallel::GetDefaultThreadCount();
+	bool useMemoryMapping = false;  // Only for operations which don't modify the archive
+	bool deduplicateFiles = false;  // Only for operations which save the archive
 
 	static inline void InternalAddEntriesToArchive(BloatArchive& archive, const std::span<char*>& paths, const bool recursive,
 		const bool overwrite)
@@ -71,12 +75,14 @@ private:
 public:
 	inline explicit ArchiveManipulator() noexcept { }
 
-	inline explicit ArchiveManipulator(const fs::path& archivePath, const std::string& password, const bool verifyChecksum) noexcept
-		: archivePath(archivePath), password(password), verifyChecksum(verifyChecksum) {}
+	inline explicit ArchiveManipulator(const fs::path& archivePath, const std::string& password, const bool verifyChecksum,
+		const size_t threadCount, const bool useMemoryMapping, const bool deduplicateFiles) noexcept
+		: archivePath(archivePath), password(password), verifyChecksum(verifyChecksum), threadCount(threadCount),
+		useMemoryMapping(useMemoryMapping), deduplicateFiles(deduplicateFiles) {}
 
 	void DisplayInfo() const
 	{
-		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum);
+		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount, useMemoryMapping);
 		const auto& obfuscator = archive.GetScrambler()->GetObfuscator();
 
 		const uint64_t bloatMultiplier = archive.GetScrambler()->GetBloatMultiplier();
@@ -87,7 +93,14 @@ public:
 		// 1998 and doesn't add QoL features? Heck, even the committee doesn't even bother to add an ASCII-only ToLower
 		// function for strings. Ditch C and move on to modernize C++ like other sane languages lol
 
-		const auto& files = archive.GetAllFiles();
+		std::vector<const ArchiveFile*> files{};
+
+		for (const ArchiveFile& file : archive.GetAllFiles())
+		{
+			if (!file.IsRemoved())
+				files.push_back(&file);
+		}
+
 		const size_t fileCount = files.size();
 
 		MemoryStream stream{};
@@ -97,7 +110,9 @@ public:
 			<< "--- General Information ---\n"
 			<< "* Archive version:  " << static_cast<int>(archive.GetVersion()) << "\n"
 			<< "* Archive size:     " << StringUtils::AddThousandsSeparators(archiveSize / 1024) << " KiB\n"
-			<< "* Unscrambled size: " << StringUtils::AddThousandsSeparators(archiveSize / bloatMultiplier / 1024) << " KiB\n"
+			<< "* Scrambled size:   " << StringUtils::AddThousandsSeparators(archive.GetScrambledSize() / 1024) << " KiB\n"
+			<< "* Unscrambled size: " << StringUtils::AddThousandsSeparators(archive.GetUnscrambledSize() / 1024) << " KiB\n"
+			<< "* Reclaimable size: " << StringUtils::AddThousandsSeparators(archive.GetReclaimableSize() / 1024) << " KiB\n"
 			<< "* Checksum:         " << archive.GetChecksum() << (!verifyChecksum ? " (unverified)" : "") << "\n\n"
 
 			<< "--- Scrambler Information ---\n"
@@ -117,15 +132,15 @@ public:
 
 		for (size_t i = 0; i < fileCount; i++)
 		{
-			const uint64_t scrambledSize   = files[i].GetScrambledSize() / 1024;  // Convert bytes to KiB
-			const uint64_t unscrambledSize = files[i].GetUnscrambledSize() / 1024;
+			const uint64_t scrambledSize   = files[i]->GetScrambledSize() / 1024;  // Convert bytes to KiB
+			const uint64_t unscrambledSize = files[i]->GetUnscrambledSize() / 1024;
 
 			stream.Write(
 				std::format("{:>4} | {:<50} | {:>20} | {:>22}\n",
 					i + 1,
-					StringUtils::Truncate(files[i].GetPath().generic_string(), 50),
-					StringUtils::AddThousandsSeparators(scrambledSize != 0ui64 ? scrambledSize : 1ui64),
-					StringUtils::AddThousandsSeparators(unscrambledSize != 0ui64 ? unscrambledSize : 1ui64)
+					StringUtils::Truncate(files[i]->GetPath().generic_string(), 50),
+					StringUtils::AddThousandsSeparators(scrambledSize != UINT64_C(0) ? scrambledSize : UINT64_C(1)),
+					StringUtils::AddThousandsSeparators(unscrambledSize != UINT64_C(0) ? unscrambledSize : UINT64_C(1))
 				)
 			);
 		}
@@ -133,9 +148,21 @@ public:
 		std::cout << stream.GetData() << "\n";
 	}
 
-	inline void VerifyIntegrity() const
+	inline void VerifyIntegrity(const bool verifyReplicas) const
 	{
-		BloatArchive::Open(archivePath, true);
+		const BloatArchive& archive = BloatArchive::Open(archivePath, true, threadCount, useMemoryMapping);
+
+		if (verifyReplicas)
+		{
+			const auto& corruptedFiles = archive.FindCorruptedReplicas();
+
+			for (const ArchiveFile* file : corruptedFiles)
+				std::cout << "\"" << file->GetPath().generic_string() << "\": The replicas of this file do not match.\n";
+
+			if (!corruptedFiles.empty())
+				throw CorruptedReplicasException(std::format("{} file(s) have corrupted replicas.", corruptedFiles.size()), corruptedFiles.size());
+		}
+
 		std::cout << "No errors have been found.\n";
 	}
 
@@ -150,6 +177,9 @@ public:
 		}
 
 		BloatArchive archive{};
+		archive.SetThreadCount(threadCount);
+		archive.SetDeduplicationEnabled(deduplicateFiles);
+
 		InternalAddEntriesToArchive(archive, paths, recursive, true);
 
 		archive.SetScrambler(scrambler);
@@ -158,15 +188,17 @@ public:
 
 	inline void Append(const std::span<char*>& paths, const bool recursive, const bool overwriteExisting) const
 	{
-		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum);
+		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount);
+		archive.SetDeduplicationEnabled(deduplicateFiles);
+
 		InternalAddEntriesToArchive(archive, paths, recursive, overwriteExisting);
 
-		archive.Save(archivePath, true);
+		archive.SaveInPlace(archivePath);
 	}
 
 	inline void Remove(const std::span<char*>& paths) const
 	{
-		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum);
+		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount);
 
 		for (const fs::path& path : paths)
 		{
@@ -189,20 +221,31 @@ public:
 			}
 		}
 
+		archive.SaveInPlace(archivePath);  // Only records the removed files. Compacting the archive reclaims their space.
+	}
+
+	inline void Compact() const
+	{
+		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount);
+		archive.SetDeduplicationEnabled(deduplicateFiles);
+
+		std::cout << "Reclaimable space: " << StringUtils::AddThousandsSeparators(archive.GetReclaimableSize() / 1024) << " KiB\n";
 		archive.Save(archivePath, true);
 	}
 
 	inline void SetScrambler(const std::shared_ptr<Scrambler>& scrambler) const
 	{
-		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum);
+		BloatArchive archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount);
 
 		archive.SetScrambler(scrambler);
+		archive.SetDeduplicationEnabled(deduplicateFiles);
+
 		archive.Save(archivePath, true);
 	}
 
 	inline void Extract(const std::span<char*>& paths, const fs::path& outputDir, const bool overwriteExisting) const
 	{
-		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum);
+		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount, useMemoryMapping);
 
 		for (const fs::path& path : paths)
 		{
@@ -228,7 +271,7 @@ public:
 
 	inline void Extract(const fs::path& outputDir, const bool overwriteExisting) const
 	{
-		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum);
+		const BloatArchive& archive = BloatArchive::Open(archivePath, verifyChecksum, threadCount, useMemoryMapping);
 
 		try
 		{
@@ -1,8 +1,11 @@
-#pragma once
-#include <execution>
+#include <array>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include "BloatArchive.h"
 #include "Exceptions.h"
 #include "Obfuscator.h"
+#include "OrderedChunkQueue.h"
 #include "Stream.h"
 #include "Utils.h"
 #include "SplitMix64.h"
@@ -16,16 +19,48 @@ size_t BloatArchive::GetActiveFileCount() const noexcept
 	return std::ranges::distance(view);
 }
 
+std::optional<size_t> BloatArchive::FindFile(const fs::path& filePath) const
+{
+	return fileIndices.Find(filePath.generic_u8string(), GetPathGetter());
+}
+
+std::span<const uint32_t> BloatArchive::FindDirectory(const fs::path& dirPath) const
+{
+	return directoryIndex.FindDirectory(PathUtils::NormalizeDirectory(dirPath), GetPathGetter());
+}
+
+void BloatArchive::IndexLastFile()
+{
+	const size_t fileIndex = files.size() - 1;
+
+	fileIndices.Set(files.back().GetPathString(), fileIndex, GetPathGetter());
+	directoryIndex.Add(fileIndex, GetPathGetter());
+}
+
 void BloatArchive::ThrowIfFileDoesNotExist(const fs::path& filePath) const
 {
 	if (!DoesFileExist(filePath))
 		throw FileNotFoundException("The specified file does not exist in the archive.", filePath);
 }
 
+std::vector<const ArchiveFile*> BloatArchive::GetActiveFiles() const
+{
+	std::vector<const ArchiveFile*> activeFiles{};
+	activeFiles.reserve(files.size());
+
+	for (const ArchiveFile& file : files)
+	{
+		if (!file.IsRemoved())
+			activeFiles.push_back(&file);
+	}
+
+	return activeFiles;
+}
+
 ArchiveFile& BloatArchive::GetFileOrThrow(const fs::path& filePath)
 {
 	ThrowIfFileDoesNotExist(filePath);
-	return files[fileIndices.at(filePath)];
+	return files[*FindFile(filePath)];
 }
 
 void BloatArchive::ExtractFile(const ArchiveFile& file, const fs::path& destDir,
@@ -50,72 +85,586 @@ void BloatArchive::ExtractFile(const ArchiveFile& file, const fs::path& destDir,
 		return;
 	}
 
-	if (!fs::exists(outputFileParentPath))
-		fs::create_directories(outputFileParentPath);
+	// Other threads may be creating the same directories at the same time, which is fine as long as they end up existing
+	std::error_code error{};
+	fs::create_directories(outputFileParentPath, error);
+
+	if (error && !fs::is_directory(outputFileParentPath))
+		throw fs::filesystem_error("The output directory could not be created.", outputFileParentPath, error);
+
+	FileStream os = FileStream::OpenWrite(outputFilePath, true);
+
+	try
+	{
+		// Files written in a single chunk get their space in one go anyway
+		if (file.GetUnscrambledSize() > FileStream::CHUNK_SIZE)
+			os.GetFile().Preallocate(0, file.GetUnscrambledSize());
+
+		file.ReadChunks([&os](const std::span<const unsigned char> chunk) { os.WriteBytes(chunk); });
+		os.Close();
+	}
+	catch (...)
+	{
+		try
+		{
+			os.Abandon();
+			fs::remove(outputFilePath);
+		}
+		catch (...) { /* Swallow to preserve the original exception. */ }
 
-	FileStream::OpenWrite(outputFilePath, true).Write(file.GetBytes());
+		throw;
+	}
 }
 
-// Some homebrewed hash accumulator function or something. We'll call it the glorious BLOATSUM (tm).
-uint64_t BloatArchive::CalculateChecksum(const bool forceRecalculate) const noexcept
+void BloatArchive::ExtractFiles(const std::vector<const ArchiveFile*>& filesToExtract, const fs::path& destDir,
+	const bool overwriteExisting, const bool throwIfDuplicated) const
+{
+	// Exceptions are stored per file so they are reported in archive order rather than in completion order
+	std::vector<std::exception_ptr> fileExceptions(filesToExtract.size());
+
+	Parallel::For(filesToExtract.size(), threadCount, [&](const size_t i)
+	{
+		try
+		{
+			ExtractFile(*filesToExtract[i], destDir, overwriteExisting, false, throwIfDuplicated);
+		}
+		catch (...)
+		{
+			fileExceptions[i] = std::current_exception();
+		}
+	});
+
+	AggregateException exceptions{};
+
+	for (const std::exception_ptr& ex : fileExceptions)
+	{
+		if (ex)
+			exceptions.Add(ex);
+	}
+
+	exceptions.ThrowIfNonempty();
+}
+
+uint64_t BloatArchive::CalculateChecksum(const bool forceRecalculate) const
 {
 	if (!forceRecalculate && isChecksumUpToDate)
 		return checksum;
 
-	// TODO: Bypass the CRT's dumb 512 (or 2048) file limit and parallelize
+	const auto& activeFiles = GetActiveFiles();
 
-	//std::vector<uint64_t> hashes(GetActiveFileCount());
-	//std::vector<uint64_t> indices(numFiles);
-	//std::iota(indices.begin(), indices.end(), 0);  // Fill indices with 0, 1, 2, ..., numFiles - 1
+	// Files whose hash is already known (e.g. from the file table) don't have to be read again, so adding a file only
+	// costs hashing that file. The rest are hashed concurrently (each worker only keeps a single file open at a time,
+	// so the CRT's file limit is not an issue).
+	std::vector<uint64_t> hashes(activeFiles.size());
 
-	//std::for_each(std::execution::par_unseq, indices.begin(), indices.end(), [this, &hashes](const uint64_t i)
-	//{
-	//	hashes[i] = SplitMix64::ComputeHash(files[i].GetBytes());
-	//});
+	Parallel::For(activeFiles.size(), threadCount, [&activeFiles, &hashes, forceRecalculate](const size_t i)
+	{
+		hashes[i] = forceRecalculate ? activeFiles[i]->CalculateHash() : activeFiles[i]->GetHash();
+	});
 
-	uint64_t acc = 0xcbf29ce484222325ui64;  // FNV offset basis number - should be a good starting value
+	checksum = CombineHashes(hashes);
+	isChecksumUpToDate = true;
 
-	for (const ArchiveFile& file : files)
-	{
-		if (file.IsRemoved())
-			continue;
+	return checksum;
+}
 
-		const uint64_t fileHash = SplitMix64::ComputeHash(file.GetBytes());
+// Some homebrewed hash accumulator function or something. We'll call it the glorious BLOATSUM (tm).
+uint64_t BloatArchive::CombineHashes(const std::vector<uint64_t>& hashes) noexcept
+{
+	uint64_t acc = UINT64_C(0xcbf29ce484222325);  // FNV offset basis number - should be a good starting value
 
-		acc ^= SplitMix64::Mix(fileHash + 0x9e3779b97f4a7c15ui64);  // Golden ratio constant
+	// Folded in order so that the result doesn't depend on the thread count
+	for (const uint64_t fileHash : hashes)
+	{
+		acc ^= SplitMix64::Mix(fileHash + UINT64_C(0x9e3779b97f4a7c15));  // Golden ratio constant
 		acc = std::rotl(acc, 13);
 		acc += fileHash;
 	}
 
-	checksum = acc;
+	return acc;
+}
+
+void BloatArchive::VerifyChecksum(const uint64_t expectedChecksum) const
+{
+	const auto& activeFiles = GetActiveFiles();
+	std::vector<uint64_t> hashes(activeFiles.size());
+
+	Parallel::For(activeFiles.size(), threadCount, [&activeFiles, &hashes](const size_t i)
+	{
+		hashes[i] = activeFiles[i]->CalculateHash();
+	});
+
+	for (size_t i = 0; i < activeFiles.size(); i++)
+	{
+		const auto& storedHash = activeFiles[i]->GetKnownHash();
+
+		if (storedHash && *storedHash != hashes[i])
+		{
+			throw ChecksumMismatchException(
+				"The file \"" + activeFiles[i]->GetPath().generic_string() + "\" is corrupted as there is a hash mismatch.", *storedHash, hashes[i]
+			);
+		}
+	}
+
+	const uint64_t calculatedChecksum = CombineHashes(hashes);
+
+	if (calculatedChecksum != expectedChecksum)
+		throw ChecksumMismatchException("The archive is corrupted as there is a checksum mismatch.", expectedChecksum, calculatedChecksum);
+
+	for (size_t i = 0; i < activeFiles.size(); i++)
+		activeFiles[i]->SetKnownHash(hashes[i]);  // Saving the archive later on won't have to read them again
+
+	checksum = calculatedChecksum;
 	isChecksumUpToDate = true;
+}
 
-	return checksum;
+std::vector<const ArchiveFile*> BloatArchive::FindDuplicates(const std::vector<const ArchiveFile*>& filesToWrite,
+	const std::vector<const ArchiveFile*>& storedFiles) const
+{
+	std::vector<const ArchiveFile*> duplicates(filesToWrite.size(), nullptr);
+
+	if (!isDeduplicationEnabled)
+		return duplicates;
+
+	GetChecksum();  // Hashes all files concurrently, unless they already are
+
+	std::unordered_map<uint64_t, std::vector<const ArchiveFile*>> originals{};
+
+	for (const ArchiveFile* file : storedFiles)
+		originals[file->GetHash()].push_back(file);
+
+	for (size_t i = 0; i < filesToWrite.size(); i++)
+	{
+		auto& candidates = originals[filesToWrite[i]->GetHash()];
+		const auto original = std::ranges::find_if(candidates, [&filesToWrite, i](const ArchiveFile* candidate) { return candidate->HasSameContent(*filesToWrite[i]); });
+
+		if (original != candidates.end())
+			duplicates[i] = *original;
+		else
+			candidates.push_back(filesToWrite[i]);
+	}
+
+	return duplicates;
+}
+
+void BloatArchive::WriteScrambledFiles(FileStream& stream, const NativeFile* nativeTarget,
+	const std::vector<const ArchiveFile*>& filesToWrite, const std::vector<const ArchiveFile*>& duplicates, MemoryStream& directory) const
+{
+	const uint64_t bloatMultiplier = scrambler->GetBloatMultiplier();
+	const bool canDuplicateReplicas = nativeTarget != nullptr && CanDuplicateReplicasInKernel();
+
+	std::vector<uint64_t> replicaSizes{};
+	std::vector<bool> copyRaw{};
+	std::vector<bool> duplicateInKernel{};
+	std::vector<bool> splitReplicas{};
+
+	// Every file is a single queue item, except for large files being rescrambled, whose replicas are separate items so
+	// that they can be produced concurrently as well
+	std::vector<size_t> firstItems{};
+	std::vector<std::pair<size_t, uint64_t>> items{};  // File index and replica
+
+	for (size_t i = 0; i < filesToWrite.size(); i++)
+	{
+		const ArchiveFile* file = filesToWrite[i];
+		replicaSizes.push_back(file->GetUnscrambledSize());
+
+		// Files already stored with the same scrambler are copied as is instead of being unscrambled and scrambled again
+		copyRaw.push_back(file->IsInternal() && file->GetScrambler() == scrambler && !duplicates[i]);
+
+		// The empty obfuscator leaves every replica identical to the first one, so only the first replica is written
+		// and the kernel duplicates it. Not worth a few system calls for small files though.
+		duplicateInKernel.push_back(!copyRaw.back() && canDuplicateReplicas
+			&& replicaSizes.back() * (bloatMultiplier - 1) >= FileStream::CHUNK_SIZE);
+
+		splitReplicas.push_back(!copyRaw.back() && !duplicateInKernel.back() && file->IsInternal()
+			&& bloatMultiplier > 1 && replicaSizes.back() > FileStream::CHUNK_SIZE);
+
+		firstItems.push_back(items.size());
+
+		if (duplicates[i])
+			continue;  // Nothing to produce
+
+		for (uint64_t replica = 0; replica < (splitReplicas.back() ? bloatMultiplier : UINT64_C(1)); replica++)
+			items.emplace_back(firstItems.size() - 1, replica);
+	}
+
+	firstItems.push_back(items.size());
+
+	// Unchanged data is copied by the writer straight from the source archive, so no worker needs to touch it
+	std::optional<NativeFile> source{};
+
+	if (nativeTarget != nullptr && std::ranges::find(copyRaw, true) != copyRaw.end())
+		source = NativeFile::OpenRead(sourcePath);
+
+	// Worker threads read and scramble upcoming files while this thread writes them out in order
+	OrderedChunkQueue queue(items.size(), QUEUED_CHUNKS_PER_THREAD * threadCount * FileStream::CHUNK_SIZE);
+
+	std::jthread producer([&]()
+	{
+		try
+		{
+			Parallel::For(items.size(), threadCount, [&](const size_t item)
+			{
+				const auto& push = [&queue, item](const std::span<const unsigned char> chunk) { queue.Push(item, chunk); };
+				const auto [i, replica] = items[item];
+
+				try
+				{
+					if (copyRaw[i])
+					{
+						if (!source)  // Otherwise the writer copies it
+							filesToWrite[i]->ReadRawChunks(push);
+					}
+					else if (splitReplicas[i])
+						filesToWrite[i]->ReadRescrambledReplica(*scrambler, replica, push);
+					else if (duplicateInKernel[i])
+						filesToWrite[i]->ReadChunks(push);
+					else if (filesToWrite[i]->IsInternal())
+						filesToWrite[i]->ReadRescrambledChunks(*scrambler, push);  // The scrambler has been changed
+					else
+						filesToWrite[i]->ReadScrambledChunks(*scrambler, push);
+
+					queue.Complete(item);
+				}
+				catch (const OrderedChunkQueue::AbortedException&)
+				{
+					throw;  // Stop handing out files
+				}
+				catch (...)
+				{
+					queue.Complete(item, std::current_exception());  // Rethrown once the writer gets to this file
+				}
+			});
+		}
+		catch (const OrderedChunkQueue::AbortedException&) { /* The writer has given up. */ }
+	});
+
+	// Where the files written so far have ended up, for their duplicates to refer to
+	std::unordered_map<const ArchiveFile*, uint64_t> writtenOffsets{};
+
+	try
+	{
+		for (size_t i = 0; i < filesToWrite.size(); i++)
+		{
+			if (const ArchiveFile* original = duplicates[i])
+			{
+				// Either written earlier on or already stored in the target
+				const auto& writtenOffset = writtenOffsets.find(original);
+				const uint64_t dataOffset = writtenOffset != writtenOffsets.end() ? writtenOffset->second : original->GetDataOffset();
+
+				WriteDirectoryEntry(directory, filesToWrite[i]->GetPathString(), false, dataOffset, replicaSizes[i] * bloatMultiplier,
+					filesToWrite[i]->GetHash());
+
+				continue;
+			}
+
+			const uint64_t dataStartOffset = stream.GetWritePosition();
+
+			if (isDeduplicationEnabled)
+				writtenOffsets[filesToWrite[i]] = dataStartOffset;
+
+			// The hash is already known by now, as the checksum has been calculated
+			WriteDirectoryEntry(directory, filesToWrite[i]->GetPathString(), false, dataStartOffset, replicaSizes[i] * bloatMultiplier,
+				filesToWrite[i]->GetHash());
+
+			uint64_t writtenSize = 0;
+
+			for (size_t item = firstItems[i]; item < firstItems[i + 1]; item++)
+			{
+				queue.Consume(item, [&stream, &writtenSize](const std::span<const unsigned char> chunk)
+				{
+					stream.WriteBytes(chunk);
+					writtenSize += chunk.size();
+				});
+			}
+
+			if (copyRaw[i] && source)
+			{
+				CopyRawData(stream, *nativeTarget, *source, *filesToWrite[i]);
+				writtenSize = filesToWrite[i]->GetScrambledSize();
+			}
+
+			if (writtenSize != (duplicateInKernel[i] ? replicaSizes[i] : replicaSizes[i] * bloatMultiplier))
+			{
+				throw InvalidOperationException(
+					"The file \"" + filesToWrite[i]->GetPath().generic_string() + "\" has been modified while the archive was being saved."
+				);
+			}
+
+			if (duplicateInKernel[i])
+				DuplicateReplicas(stream, *nativeTarget, *filesToWrite[i], dataStartOffset, replicaSizes[i]);
+		}
+	}
+	catch (...)
+	{
+		queue.Abort();
+		throw;
+	}
+}
+
+bool BloatArchive::CanDuplicateReplicasInKernel() const noexcept
+{
+	return NativeFile::SUPPORTS_COPY_RANGE && scrambler->GetBloatMultiplier() > 1
+		&& scrambler->GetObfuscator()->GetId() == ObfuscatorId::EmptyObfuscator;
+}
+
+void BloatArchive::WriteHeaderState(FileStream& stream, const uint64_t checksum, const uint64_t fileCount,
+	const uint64_t directoryOffset, const uint64_t directorySize)
+{
+	const std::array<uint64_t, 4> state{ checksum, fileCount, directoryOffset, directorySize };
+
+	stream.SetWritePosition(HEADER_STATE_OFFSET);
+	stream.Write(state);
+	stream.Flush();
+}
+
+bool BloatArchive::CanSaveInPlace(const fs::path& archivePath) const
+{
+	if (version != CURRENT_ARCHIVE_VERSION || sourcePath.empty() || !fs::equivalent(sourcePath, archivePath))
+		return false;
+
+	bool hasNewFiles = false;
+
+	for (const ArchiveFile& file : files)
+	{
+		if (!file.IsInternal())
+		{
+			hasNewFiles = true;
+			continue;
+		}
+
+		// The existing files must still be scrambled the way they're stored, and precede the new ones so that the
+		// directory lists the files in order
+		if (file.GetScrambler() != scrambler || (hasNewFiles && !file.IsRemoved()))
+			return false;
+	}
+
+	return true;
+}
+
+void BloatArchive::WriteDirectoryEntry(MemoryStream& directory, const std::u8string_view path, const bool isRemoved,
+	const uint64_t dataOffset, const uint64_t dataLength, const uint64_t hash)
+{
+	/* Directory entry structure:
+	* Path length (uint64)
+	* Path
+	* Flags (uint8, since version 4)
+	* Data offset (uint64, from the start of the archive)
+	* Data length (uint64)
+	* Hash of the unscrambled bytes (uint64)
+	*/
+
+	// The path is already in its generic form
+	directory.Write(static_cast<uint64_t>(path.length()));
+	directory.Write(path);
+
+	directory.Write<uint8_t>(isRemoved ? REMOVED_FLAG : UINT8_C(0));
+	directory.Write<uint64_t>(dataOffset);
+	directory.Write<uint64_t>(dataLength);
+	directory.Write<uint64_t>(hash);
+}
+
+uint64_t BloatArchive::GetDirectoryEntrySize(const std::u8string_view path)
+{
+	// See WriteDirectoryEntry()
+	return sizeof(uint64_t) + path.length() + sizeof(uint8_t) + 3 * sizeof(uint64_t);
+}
+
+void BloatArchive::ReadInterleavedFileTable(FileStream& stream, const uint64_t numFiles)
+{
+	for (uint64_t i = 0; i < numFiles; i++)
+	{
+		/* File structure:
+		* Path length (uint64)
+		* Path
+		* Data length (uint64)
+		* Hash of the unscrambled bytes (uint64, version 2 only)
+		* Scrambled bytes
+		*/
+
+		const uint64_t pathLength = stream.Read<uint64_t>();
+		const PathRef path = table->AddPath(stream.ReadString(pathLength));
+
+		const uint64_t byteLength = stream.Read<uint64_t>();
+		std::optional<uint64_t> hash{};
+
+		if (version >= 2)
+			hash = stream.Read<uint64_t>();
+
+		files.emplace_back(*table, path, stream.GetReadPosition(), byteLength, hash);
+		IndexLastFile();
+
+		stream.SetReadPosition(static_cast<uint64_t>(stream.GetReadPosition()) + byteLength);  // Skip to the next file
+	}
+}
+
+void BloatArchive::ReadDirectory(FileStream& stream, const fs::path& archivePath, const uint64_t numFiles)
+{
+	const uint64_t directoryOffset = stream.Read<uint64_t>();
+	directorySize = stream.Read<uint64_t>();
+
+	const uint64_t archiveSize = fs::file_size(archivePath);
+
+	if (directoryOffset > archiveSize || directorySize > archiveSize - directoryOffset)
+		throw InvalidArchiveException("The archive directory is out of bounds.");
+
+	// The paths take up whatever the fixed-size fields of the entries don't
+	const uint64_t fixedEntrySize = 4 * sizeof(uint64_t) + (version >= 4 ? sizeof(uint8_t) : 0);
+
+	if (numFiles <= directorySize / fixedEntrySize)
+		table->Reserve(static_cast<size_t>(directorySize - numFiles * fixedEntrySize));
+
+	// A single read regardless of how many files there are or how large they are (or none at all if it's mapped)
+	const auto& mapping = table->GetMapping();
+	std::vector<unsigned char> directoryBytes{};
+
+	if (!mapping)
+	{
+		directoryBytes.resize(static_cast<size_t>(directorySize));
+
+		stream.SetReadPosition(directoryOffset);
+		stream.ReadBytes(directoryBytes);
+	}
+
+	BufferReader directory(mapping ?
+		mapping->GetBytes().subspan(static_cast<size_t>(directoryOffset), static_cast<size_t>(directorySize)) : std::span<const unsigned char>(directoryBytes));
+
+	try
+	{
+		for (uint64_t i = 0; i < numFiles; i++)
+		{
+			// Straight from the directory into the path arena
+			const uint64_t pathLength = directory.Read<uint64_t>();
+			const PathRef path = table->AddPath(directory.ReadBytes(pathLength));
+
+			const uint8_t flags = version >= 4 ? directory.Read<uint8_t>() : UINT8_C(0);
+			const uint64_t dataOffset = directory.Read<uint64_t>();
+			const uint64_t dataLength = directory.Read<uint64_t>();
+			const uint64_t hash = directory.Read<uint64_t>();
+
+			if (dataOffset > directoryOffset || dataLength > directoryOffset - dataOffset)
+			{
+				throw InvalidArchiveException(
+					"The data of \"" + fs::path(table->GetPath(path.offset, path.length)).generic_string() + "\" is out of bounds."
+				);
+			}
+
+			files.emplace_back(*table, path, dataOffset, dataLength, hash);
+
+			if (flags & REMOVED_FLAG)
+				files.back().MarkAsRemoved();  // Kept so that its space is accounted for until the archive is compacted
+			else
+				IndexLastFile();
+		}
+	}
+	catch (const std::out_of_range&)
+	{
+		throw InvalidArchiveException("The archive directory is truncated.");
+	}
+}
+
+void BloatArchive::CopyRawData(FileStream& stream, const NativeFile& nativeTarget, const NativeFile& source,
+	const ArchiveFile& file) const
+{
+	const uint64_t destOffset = stream.GetWritePosition();
+	const uint64_t length = file.GetScrambledSize();
+
+	stream.Flush();  // The kernel writes behind the stream's back
+	const uint64_t copied = NativeFile::CopyRange(source, file.GetDataOffset(), nativeTarget, destOffset, length);
+
+	stream.SetWritePosition(destOffset + copied);
+
+	if (copied < length)  // Not supported here, copy the rest ourselves
+	{
+		auto sourceStream = FileStream::OpenRead(sourcePath);
+
+		sourceStream.SetReadPosition(file.GetDataOffset() + copied);
+		sourceStream.ReadChunks(length - copied, [&stream](const std::span<const unsigned char> chunk) { stream.WriteBytes(chunk); });
+	}
+}
+
+void BloatArchive::DuplicateReplicas(FileStream& stream, const NativeFile& replicaTarget, const ArchiveFile& file,
+	const uint64_t firstReplicaOffset, const uint64_t replicaSize) const
+{
+	const uint64_t bloatMultiplier = scrambler->GetBloatMultiplier();
+	const uint64_t totalSize = replicaSize * bloatMultiplier;
+
+	stream.Flush();  // The kernel copies whatever is on disk
+	uint64_t copiedSize = replicaSize;
+
+	while (copiedSize < totalSize)
+	{
+		// Copy everything written so far on each pass (copy_file_range may even reflink the blocks), so only
+		// O(log n) system calls are needed
+		const uint64_t length = std::min(copiedSize, totalSize - copiedSize);
+		const uint64_t copied = NativeFile::CopyRange(replicaTarget, firstReplicaOffset, replicaTarget, firstReplicaOffset + copiedSize, length);
+
+		copiedSize += copied;
+
+		if (copied < length)
+			break;  // Not supported here, write the remaining replicas ourselves
+	}
+
+	uint64_t replica = copiedSize / replicaSize;
+	stream.SetWritePosition(firstReplicaOffset + replica * replicaSize);
+
+	for (; replica < bloatMultiplier; replica++)
+		file.ReadChunks([&stream](const std::span<const unsigned char> chunk) { stream.WriteBytes(chunk); });
 }
 
 // Public methods
 
 BloatArchive::BloatArchive() noexcept
-	: scrambler(Scrambler::Create(1ui64, ObfuscatorFactory::Create(ObfuscatorId::RandomXorObfuscator))) { }
+	: scrambler(Scrambler::Create(UINT64_C(1), ObfuscatorFactory::Create(ObfuscatorId::RandomXorObfuscator))),
+	table(std::make_unique<FileTable>(scrambler)) { }
 
 uint8_t BloatArchive::GetVersion() const noexcept { return version; }
 
+uint64_t BloatArchive::GetStoredDataSize() const
+{
+	// Deduplicated files share their data, which must only be counted once
+	std::vector<std::pair<uint64_t, uint64_t>> usedRanges{};
+
+	for (const ArchiveFile& file : files)
+	{
+		if (file.IsInternal() && !file.IsRemoved())
+			usedRanges.emplace_back(file.GetDataOffset(), file.GetScrambledSize());
+	}
+
+	std::ranges::sort(usedRanges);
+	const auto [first, last] = std::ranges::unique(usedRanges);
+	usedRanges.erase(first, last);
+
+	uint64_t size = UINT64_C(0);
+
+	for (const auto& [offset, length] : usedRanges)
+		size += length;
+
+	return size;
+}
+
 uint64_t BloatArchive::GetScrambledSize() const
 {
-	uint64_t size = 0ui64;
+	uint64_t size = GetStoredDataSize();
 
 	for (const ArchiveFile& file : files)
-		size += file.GetScrambledSize();
+	{
+		if (!file.IsInternal() && !file.IsRemoved())
+			size += file.GetScrambledSize();
+	}
 
 	return size;
 }
 
 uint64_t BloatArchive::GetUnscrambledSize() const
 {
-	uint64_t size = 0ui64;
+	uint64_t size = UINT64_C(0);
 
 	for (const ArchiveFile& file : files)
-		size += file.GetUnscrambledSize();
+	{
+		if (!file.IsRemoved())
+			size += file.GetUnscrambledSize();
+	}
 
 	return size;
 }
@@ -123,12 +672,57 @@ uint64_t BloatArchive::GetUnscrambledSize() const
 const std::shared_ptr<Scrambler>& BloatArchive::GetScrambler() const noexcept { return scrambler; }
 void BloatArchive::SetScrambler(const std::shared_ptr<Scrambler>& scrambler) noexcept { this->scrambler = scrambler; }
 
-uint64_t BloatArchive::GetChecksum() const noexcept
+uint64_t BloatArchive::GetReclaimableSize() const
+{
+	if (version < 3 || sourcePath.empty())
+		return UINT64_C(0);  // Older archives have no room for leftovers, as they're always rewritten as a whole
+
+	const uint64_t usedSize = HEADER_SIZE + directorySize + GetStoredDataSize();
+	const uint64_t archiveSize = fs::file_size(sourcePath);
+	return archiveSize > usedSize ? archiveSize - usedSize : UINT64_C(0);
+}
+
+uint64_t BloatArchive::GetChecksum() const
 {
 	return CalculateChecksum(false);
 }
 
-BloatArchive BloatArchive::Open(const fs::path& archivePath, const bool verifyChecksum)
+std::vector<const ArchiveFile*> BloatArchive::FindCorruptedReplicas() const
+{
+	const auto& activeFiles = GetActiveFiles();
+	std::vector<char> isIntact(activeFiles.size());  // Not vector<bool>, as its elements can't be written concurrently
+
+	Parallel::For(activeFiles.size(), threadCount, [&activeFiles, &isIntact](const size_t i)
+	{
+		isIntact[i] = activeFiles[i]->AreReplicasIntact();
+	});
+
+	std::vector<const ArchiveFile*> corruptedFiles{};
+
+	for (size_t i = 0; i < activeFiles.size(); i++)
+	{
+		if (!isIntact[i])
+			corruptedFiles.push_back(activeFiles[i]);
+	}
+
+	return corruptedFiles;
+}
+
+bool BloatArchive::IsDeduplicationEnabled() const noexcept { return isDeduplicationEnabled; }
+void BloatArchive::SetDeduplicationEnabled(const bool isEnabled) noexcept { isDeduplicationEnabled = isEnabled; }
+
+size_t BloatArchive::GetThreadCount() const noexcept { return threadCount; }
+
+void BloatArchive::SetThreadCount(const size_t threadCount)
+{
+	if (threadCount == 0)
+		throw std::invalid_argument("The thread count must be greater than zero.");
+
+	this->threadCount = threadCount;
+}
+
+BloatArchive BloatArchive::Open(const fs::path& archivePath, const bool verifyChecksum, const size_t threadCount,
+	const bool useMemoryMapping)
 {
 	if (!fs::is_regular_file(archivePath))
 		throw std::invalid_argument("The specified path does not exist or represent a BLOAT archive.");
@@ -139,9 +733,16 @@ BloatArchive BloatArchive::Open(const fs::path& archivePath, const bool verifyCh
 		throw InvalidArchiveException("The correct archive magic number could not be detected.");
 
 	BloatArchive archive{};
+	archive.SetThreadCount(threadCount);
+	archive.sourcePath = archivePath;
 	archive.version = fs.Read<uint8_t>();
 
-	if (archive.version != CURRENT_ARCHIVE_VERSION)
+	std::shared_ptr<const MappedFile> mapping{};
+
+	if (useMemoryMapping)
+		mapping = MappedFile::Open(archivePath);
+
+	if (archive.version < OLDEST_SUPPORTED_ARCHIVE_VERSION || archive.version > CURRENT_ARCHIVE_VERSION)
 		throw InvalidArchiveException("The archive version is unsupported.");
 
 	const uint64_t bloatMultiplier = fs.Read<uint64_t>();
@@ -153,35 +754,24 @@ BloatArchive BloatArchive::Open(const fs::path& archivePath, const bool verifyCh
 		obfuscator->SetKey(key);
 
 	archive.scrambler = std::make_shared<Scrambler>(bloatMultiplier, obfuscator);
+	archive.table->SetSource(archivePath, archive.scrambler, mapping);
 
 	const uint64_t checksum = fs.Read<uint64_t>();
 	const uint64_t numFiles = fs.Read<uint64_t>();
 
 	archive.files.reserve(numFiles);
-	archive.fileIndices.reserve(numFiles);
+	archive.fileIndices.Reserve(numFiles);
+	archive.directoryIndex.Reserve(numFiles);
 	
-	for (uint64_t i = 0; i < numFiles; i++)
-	{
-		const uint64_t pathLength = fs.Read<uint64_t>();
-		const fs::path& path(fs.ReadString(pathLength));
-
-		const uint64_t byteLength = fs.Read<uint64_t>();
-
-		archive.files.emplace_back(ArchiveFile(path, archive.scrambler, archivePath, fs.GetReadPosition(), byteLength));
-		archive.fileIndices[path] = archive.files.size() - 1;
-
-		fs.SetReadPosition(static_cast<uint64_t>(fs.GetReadPosition()) + byteLength);  // Skip to the next file
-	}
+	if (archive.version >= 3)
+		archive.ReadDirectory(fs, archivePath, numFiles);
+	else
+		archive.ReadInterleavedFileTable(fs, numFiles);
 
 	if (verifyChecksum)
-	{
-		if (checksum != archive.GetChecksum())
-			throw ChecksumMismatchException("The archive is corrupted as there is a checksum mismatch.", checksum, archive.GetChecksum());
-	}
+		archive.VerifyChecksum(checksum);
 	else
-	{
 		archive.checksum = checksum;
-	}
 
 	archive.isChecksumVerified = archive.isChecksumUpToDate = true;
 
@@ -193,28 +783,22 @@ const std::vector<ArchiveFile>& BloatArchive::GetAllFiles() const noexcept { ret
 const ArchiveFile& BloatArchive::GetFile(const fs::path& filePath) const
 {
 	ThrowIfFileDoesNotExist(filePath);
-	return files[fileIndices.at(filePath)];
+	return files[*FindFile(filePath)];
 }
 
 bool BloatArchive::DoesFileExist(const fs::path& filePath) const noexcept
 {
-	return fileIndices.contains(filePath) && !files[fileIndices.at(filePath)].IsRemoved();
+	const auto& fileIndex = FindFile(filePath);
+	return fileIndex && !files[*fileIndex].IsRemoved();
 }
 
 bool BloatArchive::DoesDirectoryExist(const fs::path& dirPath) const noexcept
 {
-	const std::u8string& normalizedDir = PathUtils::NormalizeDirectory(dirPath);
-
-	for (const ArchiveFile& file : files)
-	{
-		if (!file.IsRemoved() && PathUtils::IsPathInsideDirectory(file.GetPath(), normalizedDir))
-			return true;
-	}
-
-	return false;
+	return std::ranges::any_of(FindDirectory(dirPath), [this](const size_t fileIndex) { return !files[fileIndex].IsRemoved(); });
 }
 
-void BloatArchive::AddFile(const fs::path& filePath, const fs::path& relativePath, const bool overwriteExisting)
+void BloatArchive::AddFile(const fs::path& filePath, const fs::path& relativePath, const uint64_t size,
+	const fs::file_time_type lastWriteTime, const bool overwriteExisting)
 {
 	if (DoesFileExist(relativePath))
 	{
@@ -224,10 +808,17 @@ void BloatArchive::AddFile(const fs::path& filePath, const fs::path& relativePat
 			throw DuplicateFileException("Another file with the same name already exists in the archive.", filePath);
 	}
 
-	files.emplace_back(ArchiveFile(filePath, relativePath, scrambler));
-	fileIndices[relativePath] = files.size() - 1;
+	files.emplace_back(*table, filePath, relativePath, size, lastWriteTime);  // Saving makes sure it hasn't changed since
+	IndexLastFile();
 
 	isChecksumUpToDate = false;
+	isModified = true;
+}
+
+void BloatArchive::AddFile(const fs::path& filePath, const fs::path& relativePath, const bool overwriteExisting)
+{
+	const fs::directory_entry entry(filePath);
+	AddFile(filePath, relativePath, entry.file_size(), entry.last_write_time(), overwriteExisting);
 }
 
 void BloatArchive::AddFile(const fs::path& filePath, const bool overwriteExisting)
@@ -240,30 +831,25 @@ void BloatArchive::AddDirectory(const fs::path& dirPath, const bool recursive, c
 	if (!fs::is_directory(dirPath))
 		throw std::invalid_argument("The specified path does not exist or is not a valid directory.");
 
+	// Listed on several threads, in path order
+	const auto& dirFiles = DirectoryWalker::Walk(dirPath, recursive, threadCount);
+
+	files.reserve(files.size() + dirFiles.size());
+	fileIndices.Reserve(files.size() + dirFiles.size());
+	directoryIndex.Reserve(files.size() + dirFiles.size());
+
 	AggregateException exceptions{};
 
-	const auto& addFile = [this, &exceptions, &dirPath, overwriteExisting](const fs::directory_entry& entry) -> void
+	for (const DirectoryWalker::File& file : dirFiles)
 	{
 		try
 		{
-			if (entry.is_regular_file())
-				AddFile(entry.path(), fs::relative(entry.path(), dirPath), overwriteExisting);
+			AddFile(file.path, fs::path(file.relativePath), file.size, file.lastWriteTime, overwriteExisting);
 		}
 		catch (...)
 		{
 			exceptions.Add(std::current_exception());
 		}
-	};
-	
-	if (recursive)
-	{
-		for (const auto& file : fs::recursive_directory_iterator(dirPath, fs::directory_options::skip_permission_denied))
-			addFile(file);
-	}
-	else
-	{
-		for (const auto& file : fs::directory_iterator(dirPath, fs::directory_options::skip_permission_denied))
-			addFile(file);
 	}
 
 	exceptions.ThrowIfNonempty();
@@ -273,18 +859,20 @@ void BloatArchive::RemoveFile(const fs::path& filePath)
 {
 	GetFileOrThrow(filePath).MarkAsRemoved();
 	isChecksumUpToDate = false;
+	isModified = true;
 }
 
 void BloatArchive::RemoveDirectory(const fs::path& dirPath)
 {
-	const std::u8string& normalizedDir = PathUtils::NormalizeDirectory(dirPath);
-
-	for (ArchiveFile& file : files)
+	for (const size_t fileIndex : FindDirectory(dirPath))
 	{
-		if (!file.IsRemoved() && PathUtils::IsPathInsideDirectory(file.GetPath(), normalizedDir))
+		ArchiveFile& file = files[fileIndex];
+
+		if (!file.IsRemoved())
 		{
 			file.MarkAsRemoved();
 			isChecksumUpToDate = false;
+			isModified = true;
 		}
 	}
 }
@@ -296,44 +884,28 @@ void BloatArchive::ExtractFile(const fs::path& filePath, const fs::path& destDir
 
 void BloatArchive::ExtractDirectory(const fs::path& dirPath, const fs::path& destDir, const bool overwriteExisting, const bool throwIfDuplicated) const
 {
-	const std::u8string& normalizedDir = PathUtils::NormalizeDirectory(dirPath);
-	AggregateException exceptions{};
+	std::vector<const ArchiveFile*> filesToExtract{};
 
-	for (const ArchiveFile& file : files)
+	for (const size_t fileIndex : FindDirectory(dirPath))
 	{
-		if (file.IsRemoved() || !PathUtils::IsPathInsideDirectory(file.GetPath(), normalizedDir))
-			continue;
-
-		try
-		{
-			ExtractFile(file, destDir, overwriteExisting, false, throwIfDuplicated);
-		}
-		catch (...)
-		{
-			exceptions.Add(std::current_exception());
-		}
+		if (!files[fileIndex].IsRemoved())
+			filesToExtract.push_back(&files[fileIndex]);
 	}
 
-	exceptions.ThrowIfNonempty();
+	std::ranges::sort(filesToExtract);  // Keep the archive order
+
+	ExtractFiles(filesToExtract, destDir, overwriteExisting, throwIfDuplicated);
 }
 
 void BloatArchive::Extract(const fs::path& destDir, const bool overwriteExistingFiles) const
 {
-	AggregateException exceptions{};
+	std::vector<const ArchiveFile*> filesToExtract{};
+	filesToExtract.reserve(files.size());
 
 	for (const ArchiveFile& file : files)
-	{
-		try
-		{
-			ExtractFile(file, destDir, overwriteExistingFiles, false, true);
-		}
-		catch (...)
-		{
-			exceptions.Add(std::current_exception());
-		}
-	}
+		filesToExtract.push_back(&file);  // Removed files are skipped by ExtractFile()
 
-	exceptions.ThrowIfNonempty();
+	ExtractFiles(filesToExtract, destDir, overwriteExistingFiles, true);
 }
 
 void BloatArchive::Save(const fs::path& destPath, const bool overwrite) const
@@ -352,49 +924,53 @@ void BloatArchive::Save(const fs::path& destPath, const bool overwrite) const
 	if (!overwrite && (fs::is_regular_file(destPath) || fs::is_regular_file(tempPath)))
 		throw DuplicateFileException(destPath);
 
+	const auto& filesToWrite = GetActiveFiles();
 	FileStream ts = FileStream::OpenWrite(tempPath, true);
 
 	try
 	{
+		const auto& duplicates = FindDuplicates(filesToWrite, {});
+		uint64_t archiveSize = HEADER_SIZE;
+
+		// Every file is written with the scrambler of the archive, not necessarily the one it has been read with
+		for (size_t i = 0; i < filesToWrite.size(); i++)
+		{
+			if (!duplicates[i])
+				archiveSize += filesToWrite[i]->GetUnscrambledSize() * scrambler->GetBloatMultiplier();
+
+			archiveSize += GetDirectoryEntrySize(filesToWrite[i]->GetPathString());
+		}
+
+		ts.GetFile().Preallocate(0, archiveSize);  // Fail early if it won't fit
+
 		// Write the header
 		ts.Write(std::string{ MAGIC_NUMBER });                                         // Magic number       (offset 0x0)
-		ts.Write<uint8_t>(CURRENT_ARCHIVE_VERSION);                                    // Archive version: 1 (offset 0x7)
+		ts.Write<uint8_t>(CURRENT_ARCHIVE_VERSION);                                    // Archive version: 4 (offset 0x7)
 		ts.Write<uint64_t>(scrambler->GetBloatMultiplier());                           // Bloat multiplier   (offset 0x8)
 		ts.Write<uint8_t>(static_cast<uint8_t>(scrambler->GetObfuscator()->GetId()));  // Obfuscator ID		 (offset 0x10)
 
 		if (scrambler->GetObfuscator()->SupportsKey())
 			ts.Write<uint64_t>(scrambler->GetObfuscator()->GetKey());                  // Obfuscator key     (offset 0x11)
 		else
-			ts.Write<uint64_t>(0ui64);
+			ts.Write<uint64_t>(UINT64_C(0));
 
 		ts.Write<uint64_t>(GetChecksum());                                             // Archive checksum   (offset 0x19)
-		ts.Write<uint64_t>(uint64_t{ GetActiveFileCount() });                          // Archive file count (offset 0x21)
+		ts.Write<uint64_t>(uint64_t{ GetActiveFileCount() });                          // Entry count       (offset 0x21)
+		ts.Write<uint64_t>(UINT64_C(0));                                               // Directory offset   (offset 0x29)
+		ts.Write<uint64_t>(UINT64_C(0));                                               // Directory size     (offset 0x31)
 
-		// Write all files to the archive
-		for (const ArchiveFile& file : files)
-		{
-			if (file.IsRemoved())
-				continue;
+		// Write all files to the archive, followed by the directory
+		MemoryStream directory{};
+		WriteScrambledFiles(ts, NativeFile::SUPPORTS_COPY_RANGE ? &ts.GetFile() : nullptr, filesToWrite, duplicates, directory);
 
-			/* File structure:
-			* Path length (uint64)
-			* Path
-			* Data length (uint64)
-			* Scrambled bytes
-			*/
+		const std::string& directoryBytes = directory.GetData();
+		const uint64_t directoryOffset = ts.GetWritePosition();
 
-			std::vector<unsigned char> bytes = file.GetBytes();
-			scrambler->Scramble(bytes);
+		ts.Write(directoryBytes);
 
-			const std::u8string& path = file.GetPath().generic_u8string();
+		// Now that the directory's location is known, fill it in
+		WriteHeaderState(ts, GetChecksum(), uint64_t{ GetActiveFileCount() }, directoryOffset, uint64_t{ directoryBytes.size() });
 
-			ts.Write(static_cast<uint64_t>(path.length()));
-			ts.Write(path);
-
-			ts.Write(static_cast<uint64_t>(bytes.size()));
-			ts.Write(bytes);
-		}
-		
 		ts.Close();
 
 		if (fs::is_regular_file(destPath))
@@ -406,7 +982,7 @@ void BloatArchive::Save(const fs::path& destPath, const bool overwrite) const
 	{
 		try
 		{
-			ts.Close();
+			ts.Abandon();
 			fs::remove(tempPath);
 		}
 		catch (...) { /* Not a big deal. Swallow to preserve the original exception. */ }
@@ -414,3 +990,96 @@ void BloatArchive::Save(const fs::path& destPath, const bool overwrite) const
 		throw;
 	}
 }
+
+void BloatArchive::SaveInPlace(const fs::path& archivePath) const
+{
+	if (!CanSaveInPlace(archivePath))
+	{
+		Save(archivePath, true);
+		return;
+	}
+
+	if (!isModified)
+		return;
+
+	// The directory lists the existing files (removed or not) where they already are, followed by the new ones
+	MemoryStream directory{};
+	std::vector<const ArchiveFile*> newFiles{};
+	std::vector<const ArchiveFile*> storedFiles{};  // Which the new files may share the data of
+
+	for (const ArchiveFile& file : files)
+	{
+		if (file.IsInternal())
+		{
+			// Internal files all come from the directory, so their hashes are known
+			WriteDirectoryEntry(directory, file.GetPathString(), file.IsRemoved(), file.GetDataOffset(), file.GetScrambledSize(),
+				file.GetKnownHash().value_or(UINT64_C(0)));
+
+			if (!file.IsRemoved())
+				storedFiles.push_back(&file);
+		}
+		else if (!file.IsRemoved())
+		{
+			newFiles.push_back(&file);
+		}
+	}
+
+	const uint64_t newChecksum = GetChecksum();  // Only hashes the new files
+	const auto& duplicates = FindDuplicates(newFiles, storedFiles);
+	const uint64_t entryCount = std::ranges::count_if(files, [](const ArchiveFile& file) { return file.IsInternal() || !file.IsRemoved(); });
+	const uint64_t originalSize = fs::file_size(archivePath);
+
+	FileStream stream = FileStream::OpenReadWrite(archivePath);
+	const NativeFile& nativeFile = stream.GetFile();  // For syncing (and kernel copies)
+
+	bool isCommitting = false;
+
+	try
+	{
+		uint64_t appendedSize = directory.GetData().length();
+
+		for (size_t i = 0; i < newFiles.size(); i++)
+		{
+			if (!duplicates[i])
+				appendedSize += newFiles[i]->GetUnscrambledSize() * scrambler->GetBloatMultiplier();
+
+			appendedSize += GetDirectoryEntrySize(newFiles[i]->GetPathString());
+		}
+
+		nativeFile.Preallocate(originalSize, appendedSize);  // Fail early if it won't fit
+
+		// Everything goes past the current end of the archive, so the current header and directory stay valid until
+		// the header is updated. An interrupted save leaves some unreferenced bytes at the end at worst.
+		stream.SetWritePosition(originalSize);
+		WriteScrambledFiles(stream, NativeFile::SUPPORTS_COPY_RANGE ? &nativeFile : nullptr, newFiles, duplicates, directory);
+
+		const std::string& directoryBytes = directory.GetData();
+		const uint64_t directoryOffset = stream.GetWritePosition();
+
+		stream.Write(directoryBytes);
+		stream.Flush();
+
+		nativeFile.Sync();  // The new data must be on the disk before anything refers to it
+
+		isCommitting = true;
+
+		WriteHeaderState(stream, newChecksum, entryCount, directoryOffset, uint64_t{ directoryBytes.size() });
+		nativeFile.Sync();
+
+		stream.Close();
+	}
+	catch (...)
+	{
+		if (!isCommitting)
+		{
+			try
+			{
+				stream.Abandon();
+				fs::resize_file(archivePath, originalSize);  // Drop whatever has been written so far
+			}
+			catch (...) { /* Not a big deal, the archive is intact anyway. Swallow to preserve the original exception. */ }
+		}
+
+		throw;
+	}
+}
\ No newline at end of file
@@ -1,9 +1,18 @@
 #pragma once
 #include <filesystem>
-#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <span>
 #include "ArchiveFile.h"
+#include "DirectoryIndex.h"
+#include "DirectoryWalker.h"
+#include "FileIndex.h"
+#include "FileTable.h"
 #include "Scrambler.h"
 #include "Exceptions.h"
+#include "MappedFile.h"
+#include "NativeFile.h"
+#include "Parallel.h"
 #include "Stream.h"
 #include "SplitMix64.h"
 #include "Xorshift64Star.h"
@@ -19,24 +28,115 @@ private:
 	mutable uint64_t checksum{};
 
 	bool isChecksumVerified = true;
+	bool isModified = false;  // Whether files have been added or removed since the archive was opened
+	bool isDeduplicationEnabled = false;
+
+	size_t threadCount = Parallel::GetDefaultThreadCount();
 
 	std::shared_ptr<Scrambler> scrambler;
+	fs::path sourcePath{};  // The file this archive has been opened from, if any
+	uint64_t directorySize = 0;  // The size of the directory in the source file (version 3+)
+
+	// What the files have in common (their paths, the source file and its scrambler and mapping). Kept on the heap so
+	// that the files can keep pointing to it when the archive is moved.
+	std::unique_ptr<FileTable> table;
 
 	std::vector<ArchiveFile> files{};
-	std::unordered_map<fs::path, size_t> fileIndices{};  // For blazing fast file duplication checks and index lookups
+	FileIndex fileIndices{};  // For blazing fast file duplication checks and index lookups
+	DirectoryIndex directoryIndex{};  // For directory lookups that don't go through every file
 
 	static inline const std::string MAGIC_NUMBER = "\xE9" "BLTBCS";  // "BLOAT Because Compression Sucks"
-	static constexpr inline const uint8_t CURRENT_ARCHIVE_VERSION = 1ui8;
+	static constexpr inline const uint8_t CURRENT_ARCHIVE_VERSION = UINT8_C(4);
+	static constexpr inline const uint8_t OLDEST_SUPPORTED_ARCHIVE_VERSION = UINT8_C(1);
+
+	// Where the header fields that change whenever files are added or removed begin (checksum, file count and, since
+	// version 3, the directory offset and size, all adjacent)
+	static constexpr inline const uint64_t HEADER_STATE_OFFSET = UINT64_C(0x19);
+	static constexpr inline const uint64_t HEADER_SIZE = UINT64_C(0x39);  // Since version 3
+
+	// Directory entry flags (version 4+)
+	static constexpr inline const uint8_t REMOVED_FLAG = UINT8_C(1);  // A tombstone: the file has been removed but its data is still there
+
+	// How many scrambled chunks each worker may have waiting for the writer when saving
+	static constexpr inline const size_t QUEUED_CHUNKS_PER_THREAD = 4;
 
 	size_t GetActiveFileCount() const noexcept;
 
+	// Gets a function which looks up the path of a file by its index, for the indices which don't keep paths of their own.
+	inline auto GetPathGetter() const noexcept { return [this](const size_t fileIndex) { return files[fileIndex].GetPathString(); }; }
+
+	std::optional<size_t> FindFile(const fs::path& filePath) const;
+	std::span<const uint32_t> FindDirectory(const fs::path& dirPath) const;
+
+	// Adds the file with the size and last write time it has been found with, so that it isn't stat'ed again.
+	void AddFile(const fs::path& filePath, const fs::path& relativePath, const uint64_t size, const fs::file_time_type lastWriteTime,
+		const bool overwriteExisting);
+
+	// Adds the last file in the list to the indices, replacing any file with the same path.
+	void IndexLastFile();
+	std::vector<const ArchiveFile*> GetActiveFiles() const;
+
+	// Gets the size of the data the files stored in the source archive take up in it, counting shared data only once.
+	uint64_t GetStoredDataSize() const;
+
 	void ThrowIfFileDoesNotExist(const fs::path& filePath) const;
 	ArchiveFile& GetFileOrThrow(const fs::path& filePath);
 
 	void ExtractFile(const ArchiveFile& file, const fs::path& destDir,
 		const bool overwriteExisting, const bool throwIfRemoved, const bool throwIfDuplicated) const;
 
-	uint64_t CalculateChecksum(const bool forceRecalculate) const noexcept;
+	// Extracts the specified files concurrently, aggregating any exceptions thrown in the process.
+	void ExtractFiles(const std::vector<const ArchiveFile*>& filesToExtract, const fs::path& destDir,
+		const bool overwriteExisting, const bool throwIfDuplicated) const;
+
+	uint64_t CalculateChecksum(const bool forceRecalculate) const;
+	static uint64_t CombineHashes(const std::vector<uint64_t>& hashes) noexcept;
+
+	// Re-reads every file, making sure both the per-file hashes (if any) and the archive checksum are intact.
+	void VerifyChecksum(const uint64_t expectedChecksum) const;
+
+	// Finds the files to write whose contents are identical to those of a file already stored in the target (or of an
+	// earlier file to write), so that they can refer to its data instead of being written again. Returns the file each
+	// of them is identical to, or nullptr. Files are only compared (byte by byte) if their hashes match, and only if
+	// deduplication is enabled.
+	std::vector<const ArchiveFile*> FindDuplicates(const std::vector<const ArchiveFile*>& filesToWrite,
+		const std::vector<const ArchiveFile*>& storedFiles) const;
+
+	// Writes the data of the specified files to the stream, scrambling upcoming files on worker threads while the current
+	// one is being written, and adds their entries to the directory. If nativeTarget refers to the same file as the
+	// stream, unchanged data and replicas may be copied by the kernel instead. Duplicates (see FindDuplicates()) aren't
+	// written, their entries referring to the data of their originals instead.
+	void WriteScrambledFiles(FileStream& stream, const NativeFile* nativeTarget, const std::vector<const ArchiveFile*>& filesToWrite,
+		const std::vector<const ArchiveFile*>& duplicates, MemoryStream& directory) const;
+
+	// Copies the stored (scrambled) data of an internal file to the current position of the stream, inside the kernel
+	// if possible.
+	void CopyRawData(FileStream& stream, const NativeFile& nativeTarget, const NativeFile& source, const ArchiveFile& file) const;
+
+	// Whether replicas can be duplicated by the kernel, i.e. they're all identical and the platform can copy file ranges.
+	bool CanDuplicateReplicasInKernel() const noexcept;
+
+	// Writes the header fields starting at HEADER_STATE_OFFSET with a single write.
+	static void WriteHeaderState(FileStream& stream, const uint64_t checksum, const uint64_t fileCount,
+		const uint64_t directoryOffset, const uint64_t directorySize);
+
+	// Whether the changes made since the archive was opened can be written to the specified archive in place.
+	bool CanSaveInPlace(const fs::path& archivePath) const;
+
+	static uint64_t GetDirectoryEntrySize(const std::u8string_view path);
+
+	static void WriteDirectoryEntry(MemoryStream& directory, const std::u8string_view path, const bool isRemoved,
+		const uint64_t dataOffset, const uint64_t dataLength, const uint64_t hash);
+
+	// Reads the file table of version 1 and 2 archives, which is interleaved with the file data.
+	void ReadInterleavedFileTable(FileStream& stream, const uint64_t numFiles);
+
+	// Reads the central directory of version 3+ archives in one go.
+	void ReadDirectory(FileStream& stream, const fs::path& archivePath, const uint64_t numFiles);
+
+	// Produces the remaining replicas of a file whose first replica has just been written to the stream.
+	void DuplicateReplicas(FileStream& stream, const NativeFile& replicaTarget, const ArchiveFile& file,
+		const uint64_t firstReplicaOffset, const uint64_t replicaSize) const;
 
 public:
 	// Creates a new empty BLOAT archive.
@@ -45,7 +145,8 @@ public:
 	// Gets the version of this BLOAT archive.
 	uint8_t GetVersion() const noexcept;
 
-	// Gets the approximate scrambled (packed) size of this BLOAT archive.
+	// Gets the approximate scrambled (packed) size of this BLOAT archive. Data shared by deduplicated files is counted once,
+	// while the unscrambled size counts it for every file.
 	uint64_t GetScrambledSize() const;
 
 	// Gets the approximate unscrambled (unpacked) size of this BLOAT archive.
@@ -55,10 +156,26 @@ public:
 	void SetScrambler(const std::shared_ptr<Scrambler>& scrambler) noexcept;
 
 	// Gets the checksum of this BLOAT archive.
-	uint64_t GetChecksum() const noexcept;
+	uint64_t GetChecksum() const;
+
+	// Reads every replica of every file and returns the files whose replicas don't match. Unlike the checksum, which
+	// only covers the first replica, this reads the entire archive.
+	std::vector<const ArchiveFile*> FindCorruptedReplicas() const;
+
+	// Gets whether files with identical contents are stored only once when the archive is saved, all of their entries
+	// referring to the same data. Not a property of the archive file: saving without it stores every file separately.
+	bool IsDeduplicationEnabled() const noexcept;
+	void SetDeduplicationEnabled(const bool isEnabled) noexcept;
 
-	// Loads an existing BLOAT archive from disk.
-	static BloatArchive Open(const fs::path& archivePath, const bool verifyChecksum = true);
+	// Gets the maximum number of threads used to process archive files.
+	size_t GetThreadCount() const noexcept;
+	void SetThreadCount(const size_t threadCount);
+
+	// Loads an existing BLOAT archive from disk. With memory mapping, the files are read straight out of a mapping of the
+	// archive instead of opening a stream for every read, which is faster for archives with lots of small files. The
+	// archive must not be modified in the meantime though, so it's only meant for reading.
+	static BloatArchive Open(const fs::path& archivePath, const bool verifyChecksum = true,
+		const size_t threadCount = Parallel::GetDefaultThreadCount(), const bool useMemoryMapping = false);
 
 	// Gets all files inside the archive.
 	const std::vector<ArchiveFile>& GetAllFiles() const noexcept;
@@ -98,4 +215,15 @@ public:
 
 	// Exports the current archive to the destination path.
 	void Save(const fs::path& destPath, const bool overwrite) const;
+
+	// Writes the changes made since the archive was opened to the archive it was opened from: added files go to the end
+	// of the archive, while removed files are recorded as tombstones in the directory and keep taking up space until
+	// the archive is compacted (i.e. saved). The changes are committed by updating the header, so the existing data
+	// isn't rewritten and the archive stays intact if this gets interrupted. Falls back to Save() if the archive can't
+	// be modified in place (e.g. it's of an older version).
+	void SaveInPlace(const fs::path& archivePath) const;
+
+	// Gets the number of bytes in the archive file that aren't used by any file (e.g. removed files) and would be
+	// reclaimed by saving (compacting) the archive.
+	uint64_t GetReclaimableSize() const;
 };
@@ -1,4 +1,7 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 
 class Bloater
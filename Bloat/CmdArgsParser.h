@@ -1,6 +1,11 @@
 #pragma once
+#include <algorithm>
+#include <charconv>
+#include <format>
 #include <span>
+#include <string_view>
 #include "Exceptions.h"
+#include "Parallel.h"
 #include "Utils.h"
 
 class CmdArgsParser
@@ -16,12 +21,13 @@ BLOAT is the first revolt against the heinous CIA (Compression Intelligence Agen
 USAGE:
   bloat help
   bloat version
-  bloat verify      <archive_path>
+  bloat verify      <archive_path> [switches...]
   bloat info        <archive_path> [switches...]
   bloat create      <archive_path> [switches...] <file1> [file2...]
   bloat add         <archive_path> [switches...] <file1> [file2...]
   bloat remove      <archive_path> [switches...] <file1> [file2...]
   bloat set         <archive_path> [switches...]
+  bloat compact     <archive_path> [switches...]
   bloat extract     <archive_path> <output_path> [switches...] <file1> [file2...]
   bloat extract-all <archive_path> <output_path> [switches...]
 
@@ -31,10 +37,13 @@ OPERATIONS:
   version                 Display the current BLOAT version.
   info                    Display the file table and information about the specified archive.
   verify                  Verify archive integrity by recalculating the checksum and ensuring it's valid.
+                          Only the first replica of every file is checked unless "--verify-replicas" is specified.
   create                  Create a new archive and add the specified files/directories to it.
   add                     Add the specified files/directories to an existing archive.
-  remove                  Remove the specified files/directories from an archive.
+  remove                  Remove the specified files/directories from an archive. The space they take up is only
+                          reclaimed once the archive is compacted.
   set                     Change the bloat multiplier and/or the obfuscator of an existing archive, then rebuild it.
+  compact                 Rebuild an archive without the space left behind by removed or overwritten files.
   extract                 Extract the specified archive files to the specified path.
   extract-all             Extract all files to the specified path.
 
@@ -58,10 +67,16 @@ SWITCHES:
 
   -password               create: Encrypt the archive with the specified password. NOT MEANT FOR ACTUAL PROTECTION.
                           Other operations: Use the specified password to open the archive if it's encrypted.
-                          Applicable to: info, create, add, remove, set, extract, extract-all
+                          Applicable to: info, create, add, remove, set, compact, extract, extract-all
                           Allowed values: Any (enclose the password in quotes if it contains space)
                           Default value: No password
 
+  -threads                Specify the maximum number of threads used to hash, save and extract archive files and to
+                          walk added directories concurrently.
+                          Applicable to: verify, info, create, add, remove, set, compact, extract, extract-all
+                          Allowed values: Positive non-zero integers (values above 1024 are treated as 1024)
+                          Default value: The number of logical processors
+
   --no-subdirs            Do not include files from subdirectories when adding directories.
                           Applicable to: create, add
                           Disabled by default.
@@ -82,7 +97,28 @@ SWITCHES:
                                 if the archive itself is corrupted. Nonetheless, archive integrity is still verified
                                 when saving the archive.
 
-                          Applicable to: info, add, remove, set, extract, extract-all
+                          Applicable to: info, add, remove, set, compact, extract, extract-all
+                          Disabled by default.
+
+  --verify-replicas       Also make sure every replica of every file is intact. Reads the entire archive, so it takes
+                          about as long as the bloat multiplier times a regular verification.
+                          Applicable to: verify
+                          Disabled by default.
+
+  --mmap                  Read the archive through a memory mapping instead of opening it for every file. Usually
+                          faster for archives with lots of small files. The archive must not be modified meanwhile.
+                          Applicable to: info, verify, extract, extract-all
+                          Disabled by default.
+
+  --dedup                 Store files with identical contents only once, all of their entries referring to the same
+                          data. Files are compared byte by byte before they're considered identical. Archives saved
+                          without it store every file separately again.
+                          Applicable to: create, add, set, compact
+                          Disabled by default.
+
+  --async-io              Keep several reads and writes in flight using io_uring instead of waiting for each one,
+                          which keeps fast SSDs busier. Linux only; ignored where io_uring isn't available.
+                          Applicable to: verify, info, create, add, remove, set, compact, extract, extract-all
                           Disabled by default.
 
   --pause                 Wait for key press instead of immediately exiting when done.
@@ -139,7 +175,7 @@ NOTES:
 EXIT CODES:
   0: The operation completed successfully.
   1: One or more arguments are malformed.
-  2: The archive is corrupted as there is a checksum mismatch.
+  2: The archive is corrupted as there is a checksum mismatch (or replica mismatch when using "--verify-replicas").
   3: The specified password is incorrect or no password was specified.
   4: An unexpected error occurred. The error message was written to the standard error stream.)";
 
@@ -153,6 +189,9 @@ EXIT CODES:
     static constexpr inline const size_t DEFAULT_FILE_PATH_START_INDEX = 3;
     static constexpr inline const size_t DEFAULT_EXTRACTION_FILE_PATH_START_INDEX = 4;
 
+    // Way more than anyone has cores for, while keeping the buffers sized by the thread count from overflowing
+    static constexpr inline const size_t MAX_THREAD_COUNT = 1024;
+
     // Example: BLOAT.exe create MyArchive.blt [+ 8 arguments]
     //static constexpr inline const size_t MAX_ARG_SEARCH_INDEX = 10;
 
@@ -209,7 +248,7 @@ EXIT CODES:
 public:
     enum class Operation
     {
-        Help, Version, Info, Verify, Create, Add, Remove, Set, Extract, ExtractAll
+        Help, Version, Info, Verify, Create, Add, Remove, Set, Compact, Extract, ExtractAll
     };
 
     enum class ExitCode
@@ -238,6 +277,7 @@ public:
             { "add",         Operation::Add        },
             { "remove",      Operation::Remove     },
             { "set",         Operation::Set        },
+            { "compact",     Operation::Compact    },
             { "extract",     Operation::Extract    },
             { "extract-all", Operation::ExtractAll }
         };
@@ -268,6 +308,10 @@ public:
     inline bool IsPauseActivated() const noexcept { return DoesSwitchExist("--pause"); }
 
     inline bool DoChecksumVerification() const noexcept { return !DoesSwitchExist("--no-verify"); }
+    inline bool DoReplicaVerification() const noexcept { return DoesSwitchExist("--verify-replicas"); }
+    inline bool DoMemoryMapping() const noexcept { return DoesSwitchExist("--mmap"); }
+    inline bool DoAsyncIo() const noexcept { return DoesSwitchExist("--async-io"); }
+    inline bool DoDeduplication() const noexcept { return DoesSwitchExist("--dedup"); }
     inline bool DoOverwriteArchive() const noexcept { return DoesSwitchExist("--overwrite-archive"); }
 
     inline bool DoOverwriteFiles() const noexcept { return DoesSwitchExist("--overwrite-files"); }
@@ -278,6 +322,29 @@ public:
     inline uint8_t GetObfuscatorId() const { return static_cast<uint8_t>(std::stoi(GetSwitchParameter("-obid").value_or("1"))); }
     inline uint64_t GetObfuscatorKey() const { return std::stoull(GetSwitchParameter("-obkey").value_or("0")); }
 
+    inline size_t GetThreadCount() const
+    {
+        const auto& threadCount = GetSwitchParameter("-threads");
+
+        if (!threadCount)
+            return Parallel::GetDefaultThreadCount();
+
+        // Unlike std::stoull(), std::from_chars() doesn't accept signs (so "-1" doesn't wrap around) and reports where it stopped
+        const std::string_view value = *threadCount;
+        const char* const last = value.data() + value.size();
+
+        size_t count = 0;
+        const auto [end, error] = std::from_chars(value.data(), last, count);
+
+        if (error == std::errc::result_out_of_range && end == last)
+            return MAX_THREAD_COUNT;
+
+        if (error != std::errc{} || end != last || count == 0)
+            throw MalformedArgumentException(std::format("The thread count must be a positive non-zero integer ('{}' was specified).", value));
+
+        return std::min(count, MAX_THREAD_COUNT);
+    }
+
     inline std::string GetPassword() const noexcept { return GetSwitchParameter("-password").value_or(""); }
 
     inline fs::path GetOutputDirectory() const
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Finds the files inside a directory of the archive without going through all of them. Keeps the index of every file,
+// sorted case-insensitively by path so that the contents of any directory form a single contiguous range. The paths
+// themselves are looked up through the getter passed to every call, so they're only kept once, in the file table.
+class DirectoryIndex
+{
+private:
+	// Sorted lazily, as files are usually added in bulk before the index is ever queried
+	mutable std::vector<uint32_t> fileIndices{};
+	mutable bool isSorted = true;
+
+	static inline char8_t ToLower(const char8_t c) noexcept { return static_cast<char8_t>(std::tolower(c)); }
+
+	static inline bool IsLess(const std::u8string_view left, const std::u8string_view right) noexcept
+	{
+		return std::ranges::lexicographical_compare(left, right, {}, ToLower, ToLower);
+	}
+
+	template<typename PathGetter>
+	inline void SortIfNeeded(const PathGetter& getPath) const
+	{
+		if (isSorted)
+			return;
+
+		std::ranges::sort(fileIndices, [&getPath](const uint32_t left, const uint32_t right) { return IsLess(getPath(left), getPath(right)); });
+		isSorted = true;
+	}
+
+public:
+	inline void Reserve(const size_t count) { fileIndices.reserve(count); }
+
+	template<typename PathGetter>
+	inline void Add(const size_t fileIndex, const PathGetter& getPath)
+	{
+		if (isSorted && !fileIndices.empty() && IsLess(getPath(fileIndex), getPath(fileIndices.back())))
+			isSorted = false;
+
+		fileIndices.push_back(static_cast<uint32_t>(fileIndex));
+	}
+
+	// Gets the indices of every file inside the directory (and its subdirectories), which must have been normalized by
+	// PathUtils::NormalizeDirectory(). Files that have been removed since they were added are included.
+	template<typename PathGetter>
+	inline std::span<const uint32_t> FindDirectory(const std::u8string& normalizedDir, const PathGetter& getPath) const
+	{
+		SortIfNeeded(getPath);
+
+		const auto first = std::ranges::lower_bound(fileIndices, std::u8string_view(normalizedDir), IsLess, getPath);
+		const auto last = std::find_if_not(first, fileIndices.end(), [&normalizedDir, &getPath](const uint32_t fileIndex)
+		{
+			const std::u8string_view path = getPath(fileIndex);
+			return path.size() >= normalizedDir.size() && std::ranges::equal(path.substr(0, normalizedDir.size()), normalizedDir, {}, ToLower);
+		});
+
+		return std::span<const uint32_t>(first, last);
+	}
+};
\ No newline at end of file
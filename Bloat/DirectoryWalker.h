@@ -0,0 +1,302 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Lists the regular files of a directory tree on several threads, each listing one directory at a time, and returns
+// them sorted by path so that the result doesn't depend on the thread count or the order the file system lists them in.
+// Like a recursive_directory_iterator skipping permission denied errors, symlinks to files are listed while symlinks to
+// directories are not followed.
+class DirectoryWalker
+{
+public:
+	struct File
+	{
+		fs::path path;
+		std::u8string relativePath;  // Generic, relative to the walked directory
+
+		uint64_t size;
+		fs::file_time_type lastWriteTime;
+	};
+
+private:
+	struct Directory
+	{
+		fs::path path;
+		std::u8string relativePath;
+	};
+
+	const bool recursive;
+	size_t maxThreadCount;
+
+	std::mutex mutex{};
+	std::condition_variable hasChanged{};
+
+	std::vector<Directory> pendingDirectories{};  // Taken from the back, so the tree is walked depth-first
+	size_t busyThreads = 0;
+	std::exception_ptr exception{};
+
+	// Started as directories pile up, so that small trees don't pay for a thread pool. Doesn't include the calling thread.
+	std::vector<std::jthread> threads{};
+
+	std::vector<File> files{};
+
+	inline explicit DirectoryWalker(const bool recursive, const size_t maxThreadCount) noexcept
+		: recursive(recursive), maxThreadCount(maxThreadCount) { }
+
+	static inline std::u8string GetRelativePath(const std::u8string& parent, const std::u8string& name)
+	{
+		return parent.empty() ? name : parent + u8'/' + name;
+	}
+
+#if defined(__linux__)
+	struct LinuxDirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+
+	static constexpr inline const size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+
+	// Only asks for what's needed, which is cheaper than a full stat on some file systems (e.g. network ones).
+	static inline int Stat(const int dirFd, const char* name, const int flags, unsigned int& mode, uint64_t& size, fs::file_time_type& lastWriteTime)
+	{
+		struct statx status{};
+
+		if (statx(dirFd, name, flags, STATX_TYPE | STATX_SIZE | STATX_MTIME, &status) == 0)
+		{
+			mode = status.stx_mode;
+			size = status.stx_size;
+			lastWriteTime = ToFileTime(status.stx_mtime.tv_sec, status.stx_mtime.tv_nsec);
+
+			return 0;
+		}
+
+		if (errno != ENOSYS)
+			return -1;
+
+		struct stat fallbackStatus{};  // Kernels older than 4.11
+
+		if (fstatat(dirFd, name, &fallbackStatus, flags) != 0)
+			return -1;
+
+		mode = fallbackStatus.st_mode;
+		size = static_cast<uint64_t>(fallbackStatus.st_size);
+		lastWriteTime = ToFileTime(fallbackStatus.st_mtim.tv_sec, fallbackStatus.st_mtim.tv_nsec);
+
+		return 0;
+	}
+
+	// Converts the time the same way fs::last_write_time() does, so that both can be compared.
+	static inline fs::file_time_type ToFileTime(const int64_t seconds, const int64_t nanoseconds)
+	{
+		const std::chrono::sys_time<std::chrono::nanoseconds> time{ std::chrono::seconds(seconds) + std::chrono::nanoseconds(nanoseconds) };
+		return std::chrono::time_point_cast<fs::file_time_type::duration>(std::chrono::file_clock::from_sys(time));
+	}
+
+	// Reads the entries with getdents64, only stat'ing regular files (and whatever the file system doesn't give the
+	// type of).
+	static inline void ListDirectory(const Directory& directory, std::vector<File>& files, std::vector<Directory>& subdirectories)
+	{
+		const int fd = open(directory.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		if (fd < 0)
+		{
+			if (errno == EACCES || errno == EPERM || errno == ENOENT)
+				return;  // Skipped, or gone in the meantime
+
+			throw fs::filesystem_error("The directory could not be opened.", directory.path, std::error_code(errno, std::system_category()));
+		}
+
+		std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+
+		try
+		{
+			while (true)
+			{
+				const long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+
+				if (length < 0)
+					throw fs::filesystem_error("The directory could not be read.", directory.path, std::error_code(errno, std::system_category()));
+
+				if (length == 0)
+					break;
+
+				for (long position = 0; position < length;)
+				{
+					const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + position);
+					position += entry->d_reclen;
+
+					const std::string_view name(entry->d_name);
+
+					if (name == "." || name == "..")
+						continue;
+
+					unsigned int mode = 0;
+					uint64_t size = 0;
+					fs::file_time_type lastWriteTime{};
+
+					bool isSymlink = entry->d_type == DT_LNK;
+
+					if (entry->d_type == DT_DIR)
+						mode = S_IFDIR;
+					else if (entry->d_type == DT_UNKNOWN)
+					{
+						// Not every file system gives the type
+						if (Stat(fd, entry->d_name, AT_SYMLINK_NOFOLLOW, mode, size, lastWriteTime) != 0)
+							continue;  // Gone in the meantime
+
+						isSymlink = S_ISLNK(mode);
+					}
+
+					// Symlinks are only listed if they point to a regular file
+					if ((entry->d_type == DT_REG || isSymlink) && Stat(fd, entry->d_name, 0, mode, size, lastWriteTime) != 0)
+						continue;  // Gone in the meantime, or a dangling symlink
+
+					if (isSymlink && S_ISDIR(mode))
+						continue;
+
+					const std::u8string relativePath = GetRelativePath(directory.relativePath, std::u8string(name.begin(), name.end()));
+
+					if (S_ISDIR(mode))
+						subdirectories.emplace_back(directory.path / name, relativePath);
+					else if (S_ISREG(mode))
+						files.emplace_back(directory.path / name, relativePath, size, lastWriteTime);
+				}
+			}
+		}
+		catch (...)
+		{
+			close(fd);
+			throw;
+		}
+
+		close(fd);
+	}
+#else
+	static inline void ListDirectory(const Directory& directory, std::vector<File>& files, std::vector<Directory>& subdirectories)
+	{
+		// The directory iterator of MSVC already has the sizes and write times of the entries, so nothing is stat'ed
+		for (const fs::directory_entry& entry : fs::directory_iterator(directory.path, fs::directory_options::skip_permission_denied))
+		{
+			const std::u8string relativePath = GetRelativePath(directory.relativePath, entry.path().filename().u8string());
+
+			if (entry.is_regular_file())
+				files.emplace_back(entry.path(), relativePath, entry.file_size(), entry.last_write_time());
+			else if (entry.is_directory() && !entry.is_symlink())
+				subdirectories.emplace_back(entry.path(), relativePath);
+		}
+	}
+#endif
+
+	// Lists pending directories until there are none left and no other thread may add any.
+	inline void Work()
+	{
+		std::unique_lock lock(mutex);
+
+		while (true)
+		{
+			hasChanged.wait(lock, [this]() { return !pendingDirectories.empty() || busyThreads == 0 || exception; });
+
+			if (exception || pendingDirectories.empty())
+				return;
+
+			const Directory directory = std::move(pendingDirectories.back());
+			pendingDirectories.pop_back();
+			busyThreads++;
+
+			lock.unlock();
+
+			std::vector<File> directoryFiles{};
+			std::vector<Directory> subdirectories{};
+			std::exception_ptr directoryException{};
+
+			try
+			{
+				ListDirectory(directory, directoryFiles, subdirectories);
+			}
+			catch (...)
+			{
+				directoryException = std::current_exception();
+			}
+
+			lock.lock();
+			busyThreads--;
+
+			if (directoryException && !exception)
+				exception = directoryException;
+
+			files.insert(files.end(), std::make_move_iterator(directoryFiles.begin()), std::make_move_iterator(directoryFiles.end()));
+
+			if (recursive)
+				pendingDirectories.insert(pendingDirectories.end(), std::make_move_iterator(subdirectories.begin()), std::make_move_iterator(subdirectories.end()));
+
+			StartThreadsIfNeeded();
+			hasChanged.notify_all();
+		}
+	}
+
+	// Starts another thread for every pending directory no idle thread is going to take, up to the maximum. Must be
+	// called with the mutex locked.
+	inline void StartThreadsIfNeeded()
+	{
+		if (exception)
+			return;
+
+		while (threads.size() + 1 < maxThreadCount && pendingDirectories.size() > threads.size() + 1 - busyThreads)
+		{
+			try
+			{
+				threads.emplace_back([this]() { Work(); });
+			}
+			catch (const std::system_error&)
+			{
+				maxThreadCount = threads.size() + 1;  // Out of threads, make do with the ones already running
+			}
+		}
+	}
+
+public:
+	// Gets the regular files inside the directory (and its subdirectories, if recursive), sorted by relative path.
+	static inline std::vector<File> Walk(const fs::path& dirPath, const bool recursive, const size_t threadCount)
+	{
+		// A single directory can't be split between threads
+		DirectoryWalker walker(recursive, recursive ? std::max<size_t>(threadCount, 1) : 1);
+		walker.pendingDirectories.emplace_back(dirPath, std::u8string{});
+
+		walker.Work();  // The calling thread starts off alone
+
+		// Once the calling thread is done, so is everyone else (or an exception has been thrown), so no more threads are
+		// started and they can be joined without locking
+		for (std::jthread& thread : walker.threads)
+			thread.join();
+
+		if (walker.exception)
+			std::rethrow_exception(walker.exception);
+
+		std::ranges::sort(walker.files, {}, &File::relativePath);
+		return std::move(walker.files);
+	}
+};
\ No newline at end of file
@@ -1,6 +1,11 @@
 #pragma once
+#include <exception>
+#include <filesystem>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
 
 class AggregateException : public std::runtime_error
 {
@@ -56,6 +61,18 @@ public:
     inline uint64_t GetCalculatedChecksum() const noexcept { return calculatedChecksum; }
 };
 
+class CorruptedReplicasException : public std::runtime_error
+{
+private:
+    const size_t corruptedFileCount;
+
+public:
+    inline explicit CorruptedReplicasException(const std::string& message, const size_t corruptedFileCount) noexcept
+        : std::runtime_error(message), corruptedFileCount(corruptedFileCount) {}
+
+    inline size_t GetCorruptedFileCount() const noexcept { return corruptedFileCount; }
+};
+
 class DuplicateFileException : public std::runtime_error
 {
 private:
@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+// Maps the paths of the files in the archive to their indices. A flat open-addressing hash table that only stores the
+// indices (and a part of each hash), the paths themselves being looked up through the getter passed to every call so
+// they're only kept once, in the file table.
+class FileIndex
+{
+private:
+	struct Slot
+	{
+		uint32_t hash;
+		uint32_t fileIndex;  // Plus one, so that zero marks an empty slot
+	};
+
+	std::vector<Slot> slots{};
+	size_t count = 0;
+
+	static constexpr inline const size_t MIN_SLOT_COUNT = 16;
+
+	static inline uint32_t Hash(const std::u8string_view path) noexcept
+	{
+		return static_cast<uint32_t>(std::hash<std::u8string_view>{}(path));
+	}
+
+	inline size_t GetMask() const noexcept { return slots.size() - 1; }
+
+	// Gets the slot holding the path, or the empty slot it would go in.
+	template<typename PathGetter>
+	inline size_t FindSlot(const std::u8string_view path, const uint32_t hash, const PathGetter& getPath) const
+	{
+		for (size_t i = hash & GetMask(); ; i = (i + 1) & GetMask())
+		{
+			const Slot& slot = slots[i];
+
+			if (slot.fileIndex == 0 || (slot.hash == hash && getPath(slot.fileIndex - 1) == path))
+				return i;
+		}
+	}
+
+	// Moves every index to a table of the specified (power of two) size. The stored hashes are enough to place them.
+	inline void Rehash(const size_t slotCount)
+	{
+		std::vector<Slot> oldSlots(slotCount, Slot{});
+		oldSlots.swap(slots);
+
+		for (const Slot& slot : oldSlots)
+		{
+			if (slot.fileIndex == 0)
+				continue;
+
+			size_t i = slot.hash & GetMask();
+
+			while (slots[i].fileIndex != 0)
+				i = (i + 1) & GetMask();
+
+			slots[i] = slot;
+		}
+	}
+
+public:
+	// Makes room for the specified number of files, keeping the table at most half full.
+	inline void Reserve(const size_t fileCount)
+	{
+		size_t slotCount = MIN_SLOT_COUNT;
+
+		while (slotCount < fileCount * 2)
+			slotCount *= 2;
+
+		if (slotCount > slots.size())
+			Rehash(slotCount);
+	}
+
+	// Gets the index of the file with the specified path, if any.
+	template<typename PathGetter>
+	inline std::optional<size_t> Find(const std::u8string_view path, const PathGetter& getPath) const
+	{
+		if (count == 0)
+			return std::nullopt;
+
+		const Slot& slot = slots[FindSlot(path, Hash(path), getPath)];
+
+		if (slot.fileIndex == 0)
+			return std::nullopt;
+
+		return slot.fileIndex - 1;
+	}
+
+	// Points the path to the specified file index, replacing the file it pointed to (if any).
+	template<typename PathGetter>
+	inline void Set(const std::u8string_view path, const size_t fileIndex, const PathGetter& getPath)
+	{
+		if (fileIndex >= UINT32_MAX)
+			throw std::length_error("The archive contains too many files.");
+
+		if ((count + 1) * 2 > slots.size())
+			Rehash(std::max(MIN_SLOT_COUNT, slots.size() * 2));
+
+		const uint32_t hash = Hash(path);
+		Slot& slot = slots[FindSlot(path, hash, getPath)];
+
+		if (slot.fileIndex == 0)
+			count++;
+
+		slot = Slot{ hash, static_cast<uint32_t>(fileIndex + 1) };
+	}
+};
\ No newline at end of file
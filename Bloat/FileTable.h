@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "MappedFile.h"
+#include "Scrambler.h"
+
+namespace fs = std::filesystem;
+
+// Where a string lives in the path arena of a file table
+struct PathRef
+{
+	uint64_t offset;
+	uint32_t length;
+};
+
+// Holds what the files of an archive have in common, so that each file only has to keep a few offsets and lengths:
+// the paths of every file, one after another in a single buffer, and where the internal files are stored.
+class FileTable
+{
+private:
+	std::u8string paths{};  // Grows as files are added, so views into it only last until the next file is added
+
+	fs::path archivePath{};  // The archive the internal files are stored in
+	std::shared_ptr<Scrambler> scrambler;  // The scrambler the archive has been opened (or created) with
+	std::shared_ptr<const MappedFile> mapping{};  // The archive mapped into memory, if opened that way
+
+public:
+	inline explicit FileTable(const std::shared_ptr<Scrambler>& scrambler) noexcept : scrambler(scrambler) { }
+
+	// Path lengths are kept in 32 bits, which is plenty for any file system
+	static constexpr inline const uint64_t MAX_PATH_LENGTH = UINT32_MAX;
+
+	inline void Reserve(const size_t pathBytes) { paths.reserve(pathBytes); }
+
+	// Copies the path (any range of UTF-8 code units or bytes) into the arena.
+	template<typename Range>
+	inline PathRef AddPath(const Range& path)
+	{
+		const uint64_t length = std::ranges::size(path);
+
+		if (length > MAX_PATH_LENGTH)
+			throw std::length_error("The path is too long.");
+
+		const PathRef ref{ paths.size(), static_cast<uint32_t>(length) };
+		paths.append(std::ranges::begin(path), std::ranges::end(path));
+
+		return ref;
+	}
+
+	inline std::u8string_view GetPath(const uint64_t offset, const uint32_t length) const noexcept
+	{
+		return std::u8string_view(paths).substr(static_cast<size_t>(offset), length);
+	}
+
+	inline const fs::path& GetArchivePath() const noexcept { return archivePath; }
+	inline const std::shared_ptr<Scrambler>& GetScrambler() const noexcept { return scrambler; }
+	inline const std::shared_ptr<const MappedFile>& GetMapping() const noexcept { return mapping; }
+
+	// Sets where the internal files are read from and how they're scrambled.
+	inline void SetSource(const fs::path& archivePath, const std::shared_ptr<Scrambler>& scrambler,
+		const std::shared_ptr<const MappedFile>& mapping) noexcept
+	{
+		this->archivePath = archivePath;
+		this->scrambler = scrambler;
+		this->mapping = mapping;
+	}
+};
\ No newline at end of file
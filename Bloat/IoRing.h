@@ -0,0 +1,258 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <system_error>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Tracks a read or write submitted to an IoRing.
+struct IoRequest
+{
+	bool isComplete = true;
+	int32_t result = 0;  // The number of bytes transferred, or a negated errno
+};
+
+// A bare-bones io_uring, set up with raw system calls, through which a thread can keep several reads and writes in
+// flight instead of blocking on each one. Every thread gets a ring of its own, so there's no locking. Only available on
+// Linux (5.6+) and only when enabled; FileStream sticks to regular blocking I/O otherwise.
+class IoRing
+{
+private:
+	static inline std::atomic<bool> isEnabled = false;
+
+#if defined(__linux__)
+	int ringFd = -1;
+	unsigned queueSize = 0;
+	unsigned inFlight = 0;
+
+	void* submissionRing = nullptr;
+	void* completionRing = nullptr;
+	size_t submissionRingSize = 0, completionRingSize = 0;
+
+	io_uring_sqe* submissions = nullptr;
+	size_t submissionsSize = 0;
+
+	unsigned* submissionTail = nullptr;
+	unsigned* submissionMask = nullptr;
+	unsigned* submissionArray = nullptr;
+
+	unsigned* completionHead = nullptr;
+	unsigned* completionTail = nullptr;
+	unsigned* completionMask = nullptr;
+	io_uring_cqe* completions = nullptr;
+
+	inline IoRing() noexcept = default;
+
+	static inline int Enter(const int fd, const unsigned toSubmit, const unsigned minComplete, const unsigned flags) noexcept
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	static inline std::unique_ptr<IoRing> Create() noexcept
+	{
+		io_uring_params params{};
+		const int fd = static_cast<int>(syscall(__NR_io_uring_setup, QUEUE_SIZE, &params));
+
+		if (fd < 0)
+			return nullptr;  // Not supported (or disabled) by the kernel
+
+		std::unique_ptr<IoRing> ring(new IoRing());
+		ring->ringFd = fd;
+		ring->queueSize = params.sq_entries;
+
+		if (!(params.features & IORING_FEAT_RW_CUR_POS))
+			return nullptr;  // Older than 5.6, i.e. no plain read and write operations
+
+		ring->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		ring->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		const bool isSingleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+
+		if (isSingleMapping)
+			ring->submissionRingSize = ring->completionRingSize = std::max(ring->submissionRingSize, ring->completionRingSize);
+
+		ring->submissionRing = mmap(nullptr, ring->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+		if (ring->submissionRing == MAP_FAILED)
+		{
+			ring->submissionRing = nullptr;
+			return nullptr;
+		}
+
+		ring->completionRing = isSingleMapping ? ring->submissionRing :
+			mmap(nullptr, ring->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+		if (ring->completionRing == MAP_FAILED)
+		{
+			ring->completionRing = nullptr;
+			return nullptr;
+		}
+
+		ring->submissionsSize = params.sq_entries * sizeof(io_uring_sqe);
+		void* submissions = mmap(nullptr, ring->submissionsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+		if (submissions == MAP_FAILED)
+			return nullptr;
+
+		ring->submissions = static_cast<io_uring_sqe*>(submissions);
+
+		auto* const sq = static_cast<unsigned char*>(ring->submissionRing);
+		auto* const cq = static_cast<unsigned char*>(ring->completionRing);
+
+		ring->submissionTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		ring->submissionMask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		ring->submissionArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+		ring->completionHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		ring->completionTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		ring->completionMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		ring->completions    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		return ring;
+	}
+
+	inline void Submit(const uint8_t opcode, const int fd, const uint64_t offset, const void* data, const size_t length, IoRequest& request)
+	{
+		while (inFlight >= queueSize)  // Make room first (the completion queue is twice as large, so it can't overflow)
+			ReapCompletion();
+
+		const unsigned tail = *submissionTail;
+		const unsigned index = tail & *submissionMask;
+
+		io_uring_sqe& submission = submissions[index];
+		std::memset(&submission, 0, sizeof(submission));
+
+		submission.opcode = opcode;
+		submission.fd = fd;
+		submission.off = offset;
+		submission.addr = reinterpret_cast<uint64_t>(data);
+		submission.len = static_cast<uint32_t>(length);
+		submission.user_data = reinterpret_cast<uint64_t>(&request);
+
+		submissionArray[index] = index;
+		std::atomic_ref(*submissionTail).store(tail + 1, std::memory_order_release);
+
+		request.isComplete = false;
+		inFlight++;
+
+		while (Enter(ringFd, 1, 0, 0) < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				const int error = errno;
+
+				// The kernel hasn't taken the request, so take it back. Otherwise whoever waits for it would wait forever.
+				std::atomic_ref(*submissionTail).store(tail, std::memory_order_release);
+				inFlight--;
+
+				request.result = -error;
+				request.isComplete = true;
+
+				throw fs::filesystem_error("The I/O request could not be submitted.", std::error_code(error, std::generic_category()));
+			}
+		}
+	}
+
+	// Waits for any request to complete and records its result.
+	inline void ReapCompletion()
+	{
+		while (true)
+		{
+			const unsigned head = *completionHead;
+
+			if (head != std::atomic_ref(*completionTail).load(std::memory_order_acquire))
+			{
+				const io_uring_cqe& completion = completions[head & *completionMask];
+				IoRequest& request = *reinterpret_cast<IoRequest*>(completion.user_data);
+
+				request.result = completion.res;
+				request.isComplete = true;
+
+				std::atomic_ref(*completionHead).store(head + 1, std::memory_order_release);
+				inFlight--;
+
+				return;
+			}
+
+			if (Enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				throw fs::filesystem_error("Waiting for I/O requests failed.", std::error_code(errno, std::generic_category()));
+		}
+	}
+#else
+	static inline std::unique_ptr<IoRing> Create() noexcept { return nullptr; }
+#endif
+
+public:
+	static constexpr inline const unsigned QUEUE_SIZE = 64;
+
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	inline ~IoRing()
+	{
+#if defined(__linux__)
+		if (submissions != nullptr)
+			munmap(submissions, submissionsSize);
+
+		if (completionRing != nullptr && completionRing != submissionRing)
+			munmap(completionRing, completionRingSize);
+
+		if (submissionRing != nullptr)
+			munmap(submissionRing, submissionRingSize);
+
+		if (ringFd >= 0)
+			close(ringFd);
+#endif
+	}
+
+	// Enables or disables asynchronous I/O for the whole process.
+	static inline void SetEnabled(const bool enabled) noexcept { isEnabled = enabled; }
+
+	// Gets the ring of the calling thread, or null if asynchronous I/O is disabled or not supported.
+	static inline IoRing* GetForThisThread() noexcept
+	{
+		if (!isEnabled)
+			return nullptr;
+
+		thread_local const std::unique_ptr<IoRing> ring = Create();
+		return ring.get();
+	}
+
+	// Starts reading into the buffer, which must stay alive until the request completes.
+	inline void SubmitRead(const int fd, const uint64_t offset, const std::span<unsigned char> buffer, IoRequest& request)
+	{
+#if defined(__linux__)
+		Submit(IORING_OP_READ, fd, offset, buffer.data(), buffer.size(), request);
+#endif
+	}
+
+	// Starts writing the bytes, which must stay alive until the request completes.
+	inline void SubmitWrite(const int fd, const uint64_t offset, const std::span<const unsigned char> bytes, IoRequest& request)
+	{
+#if defined(__linux__)
+		Submit(IORING_OP_WRITE, fd, offset, bytes.data(), bytes.size(), request);
+#endif
+	}
+
+	// Blocks until the request has completed. Completions of other requests that arrive in the meantime are recorded as well.
+	inline void Wait(IoRequest& request)
+	{
+#if defined(__linux__)
+		while (!request.isComplete)
+			ReapCompletion();
+#endif
+	}
+};
\ No newline at end of file
@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <filesystem>
+#include <format>
 #include "ArchiveManipulator.h"
 #include "BloatArchive.h"
 #include "CmdArgsParser.h"
@@ -34,7 +35,10 @@ static inline ArchiveManipulator CreateArchiveManipulator(const CmdArgsParser& p
 			return ArchiveManipulator{};
 
 		default:
-			return ArchiveManipulator{ parser.GetArchivePath(), parser.GetPassword(), parser.DoChecksumVerification() };
+			return ArchiveManipulator{
+				parser.GetArchivePath(), parser.GetPassword(), parser.DoChecksumVerification(), parser.GetThreadCount(),
+				parser.DoMemoryMapping(), parser.DoDeduplication()
+			};
 	}
 }
 
@@ -46,7 +50,7 @@ static inline std::shared_ptr<Scrambler> CreateScrambler(const CmdArgsParser& pa
 
 	const uint64_t key = parser.GetObfuscatorKey();
 
-	if (key != 0ui64)
+	if (key != UINT64_C(0))
 		scrambler->GetObfuscator()->SetKey(key);
 
 	return scrambler;
@@ -70,6 +74,8 @@ int main(int argc, char* argv[])
 		const CmdArgsParser& parser{ argc, argv };
 		pause = parser.IsPauseActivated();
 
+		IoRing::SetEnabled(parser.DoAsyncIo());
+
 		const Operation operation = parser.GetOperation();
 		const ArchiveManipulator& am = CreateArchiveManipulator(parser);
 
@@ -81,7 +87,7 @@ int main(int argc, char* argv[])
 				break;
 
 			case Operation::Verify:
-				am.VerifyIntegrity();
+				am.VerifyIntegrity(parser.DoReplicaVerification());
 				showSuccessMessage = false;
 				break;
 
@@ -101,6 +107,10 @@ int main(int argc, char* argv[])
 				am.SetScrambler(CreateScrambler(parser));
 				break;
 
+			case Operation::Compact:
+				am.Compact();
+				break;
+
 			case Operation::Extract:
 				am.Extract(parser.GetEntryPaths(), parser.GetOutputDirectory(), parser.DoOverwriteFiles());
 				break;
@@ -137,6 +147,11 @@ int main(int argc, char* argv[])
 
 		return GetExitCode(ExitCode::ChecksumMismatch, pause);
 	}
+	catch (const CorruptedReplicasException& ex)
+	{
+		std::cerr << "The integrity check of the specified archive has failed: " << ex.what() << "\n";
+		return GetExitCode(ExitCode::ChecksumMismatch, pause);
+	}
 	catch (const std::invalid_argument& ex)
 	{
 		std::cerr << "An error occurred while parsing input arguments: " << ex.what() << "\n"
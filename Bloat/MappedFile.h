@@ -0,0 +1,134 @@
+#pragma once
+#include <cerrno>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <system_error>
+
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+
+// Declared by hand to avoid pulling in <windows.h> (and its macros, such as RemoveDirectory)
+extern "C"
+{
+	__declspec(dllimport) void* __stdcall CreateFileMappingW(void* hFile, void* lpFileMappingAttributes, unsigned long flProtect,
+		unsigned long dwMaximumSizeHigh, unsigned long dwMaximumSizeLow, const wchar_t* lpName);
+	__declspec(dllimport) void* __stdcall MapViewOfFile(void* hFileMappingObject, unsigned long dwDesiredAccess,
+		unsigned long dwFileOffsetHigh, unsigned long dwFileOffsetLow, size_t dwNumberOfBytesToMap);
+	__declspec(dllimport) int __stdcall UnmapViewOfFile(const void* lpBaseAddress);
+	__declspec(dllimport) int __stdcall CloseHandle(void* hObject);
+	__declspec(dllimport) unsigned long __stdcall GetLastError();
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// A read-only memory mapping of an entire file. Archive files can be read straight out of it without opening a stream
+// or copying anything into user-space buffers.
+class MappedFile
+{
+private:
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+#if _WIN32
+	static constexpr inline const unsigned long PAGE_READONLY_PROTECTION = 0x02;
+	static constexpr inline const unsigned long FILE_MAP_READ_ACCESS = 0x04;
+#endif
+
+	inline MappedFile() noexcept = default;
+
+	// Maps the file behind the descriptor, returning the system error if it couldn't be mapped.
+	inline std::error_code Map(const int fd) noexcept
+	{
+#if _WIN32
+		struct _stat64 status{};
+
+		if (_fstat64(fd, &status) != 0)
+			return std::error_code(errno, std::generic_category());
+#else
+		struct stat status{};
+
+		if (fstat(fd, &status) != 0)
+			return std::error_code(errno, std::generic_category());
+#endif
+
+		size = static_cast<size_t>(status.st_size);
+
+		if (size == 0)  // Empty files can't be mapped, and there's nothing to read anyway
+			return {};
+
+#if _WIN32
+		void* mapping = CreateFileMappingW(reinterpret_cast<void*>(_get_osfhandle(fd)), nullptr, PAGE_READONLY_PROTECTION, 0, 0, nullptr);
+
+		if (mapping == nullptr)
+			return std::error_code(static_cast<int>(GetLastError()), std::system_category());
+
+		data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ_ACCESS, 0, 0, 0));
+		const std::error_code error(static_cast<int>(GetLastError()), std::system_category());
+
+		CloseHandle(mapping);  // The view keeps the mapping alive
+		return data != nullptr ? std::error_code{} : error;
+#else
+		void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (address == MAP_FAILED)
+			return std::error_code(errno, std::generic_category());
+
+		data = static_cast<const unsigned char*>(address);
+		return {};
+#endif
+	}
+
+public:
+	// Maps the specified file into memory. The file must not be modified while it's mapped.
+	static inline std::shared_ptr<const MappedFile> Open(const fs::path& path)
+	{
+#if _WIN32
+		const int fd = _wopen(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+
+		if (fd < 0)
+			throw fs::filesystem_error("The specified file could not be opened.", path, std::error_code(errno, std::generic_category()));
+
+		std::shared_ptr<MappedFile> file(new MappedFile());
+		const std::error_code error = file->Map(fd);
+
+#if _WIN32
+		_close(fd);  // The mapping keeps the file referenced
+#else
+		close(fd);
+#endif
+
+		if (error)
+			throw fs::filesystem_error("The specified file could not be mapped into memory.", path, error);
+
+		return file;
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	inline ~MappedFile()
+	{
+		if (data == nullptr)
+			return;
+
+#if _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(const_cast<unsigned char*>(data), size);
+#endif
+	}
+
+	inline std::span<const unsigned char> GetBytes() const noexcept { return { data, size }; }
+};
\ No newline at end of file
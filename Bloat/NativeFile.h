@@ -0,0 +1,327 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <filesystem>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// A raw OS file descriptor: positioned reads and writes (the backend of FileStream) and the things std::fstream can't
+// do, such as kernel-side copies.
+class NativeFile
+{
+private:
+	int fd = -1;
+
+	inline explicit NativeFile(const int fd) noexcept : fd(fd) { }
+
+#if defined(__linux__)
+	// The fallback of CopyRange(). Still copies inside the kernel, but only through the page cache.
+	static inline uint64_t SendRange(const NativeFile& source, const uint64_t sourceOffset,
+		const NativeFile& dest, const uint64_t destOffset, const uint64_t length)
+	{
+		if (lseek(dest.fd, static_cast<off_t>(destOffset), SEEK_SET) < 0)
+			return UINT64_C(0);
+
+		off_t in = static_cast<off_t>(sourceOffset);
+		uint64_t copied = 0;
+
+		while (copied < length)
+		{
+			const ssize_t result = sendfile(dest.fd, source.fd, &in, static_cast<size_t>(std::min<uint64_t>(length - copied, UINT64_C(0x7ffff000))));
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (IsUnsupportedError(errno))
+					break;
+
+				ThrowLastError("The kernel failed to copy the file range.");
+			}
+
+			if (result == 0)  // Source EOF
+				break;
+
+			copied += static_cast<uint64_t>(result);
+		}
+
+		return copied;
+	}
+#endif
+
+	[[noreturn]] static inline void ThrowLastError(const char* message, const fs::path& path = {})
+	{
+		const std::error_code error(errno, std::generic_category());
+
+		if (path.empty())
+			throw fs::filesystem_error(message, error);
+
+		throw fs::filesystem_error(message, path, error);
+	}
+
+	static inline bool IsUnsupportedError(const int error) noexcept
+	{
+		// The file system or kernel can't do it - not an actual I/O error
+		return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+	}
+
+public:
+	// Whether CopyRange() can possibly copy anything on this platform.
+#if defined(__linux__)
+	static constexpr inline const bool SUPPORTS_COPY_RANGE = true;
+#else
+	static constexpr inline const bool SUPPORTS_COPY_RANGE = false;
+#endif
+
+	inline static NativeFile OpenRead(const fs::path& path)
+	{
+#if _WIN32
+		const int fd = _wopen(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+
+		if (fd < 0)
+			ThrowLastError("The specified file could not be opened.", path);
+
+		return NativeFile(fd);
+	}
+
+	inline static NativeFile OpenReadWrite(const fs::path& path)
+	{
+#if _WIN32
+		const int fd = _wopen(path.c_str(), _O_RDWR | _O_BINARY);
+#else
+		const int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+#endif
+
+		if (fd < 0)
+			ThrowLastError("The specified file could not be opened.", path);
+
+		return NativeFile(fd);
+	}
+
+	// Creates the specified file, or truncates it if it already exists and overwrite is set.
+	inline static NativeFile OpenWrite(const fs::path& path, const bool overwrite)
+	{
+#if _WIN32
+		const int fd = _wopen(path.c_str(), _O_RDWR | _O_BINARY | _O_CREAT | (overwrite ? _O_TRUNC : _O_EXCL), _S_IREAD | _S_IWRITE);
+#else
+		const int fd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | (overwrite ? O_TRUNC : O_EXCL), 0666);
+#endif
+
+		if (fd < 0)
+			ThrowLastError("The specified file could not be created.", path);
+
+		return NativeFile(fd);
+	}
+
+	NativeFile(const NativeFile&) = delete;
+	NativeFile& operator=(const NativeFile&) = delete;
+
+	inline NativeFile(NativeFile&& other) noexcept : fd(std::exchange(other.fd, -1)) { }
+
+	inline NativeFile& operator=(NativeFile&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Close();
+			fd = std::exchange(other.fd, -1);
+		}
+
+		return *this;
+	}
+
+	inline ~NativeFile() { Close(); }
+
+	inline int GetDescriptor() const noexcept { return fd; }
+	inline bool IsOpen() const noexcept { return fd >= 0; }
+
+	inline uint64_t GetSize() const
+	{
+#if _WIN32
+		struct _stat64 status{};
+
+		if (_fstat64(fd, &status) != 0)
+#else
+		struct stat status{};
+
+		if (fstat(fd, &status) != 0)
+#endif
+			ThrowLastError("The size of the file could not be determined.");
+
+		return static_cast<uint64_t>(status.st_size);
+	}
+
+	// Reads into the buffer starting at the specified offset, returning the number of bytes read, which is only less than
+	// the size of the buffer at the end of the file. Uses pread, so the descriptor can be shared between readers, except
+	// on Windows, which has to seek first.
+	inline size_t ReadAt(const uint64_t offset, const std::span<unsigned char> buffer) const
+	{
+#if _WIN32
+		if (_lseeki64(fd, static_cast<long long>(offset), SEEK_SET) < 0)
+			ThrowLastError("The file could not be read.");
+#endif
+
+		size_t total = 0;
+
+		while (total < buffer.size())
+		{
+#if _WIN32
+			const int result = _read(fd, buffer.data() + total, static_cast<unsigned int>(std::min<size_t>(buffer.size() - total, INT_MAX)));
+#else
+			const ssize_t result = pread(fd, buffer.data() + total, buffer.size() - total, static_cast<off_t>(offset + total));
+#endif
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				ThrowLastError("The file could not be read.");
+			}
+
+			if (result == 0)  // EOF
+				break;
+
+			total += static_cast<size_t>(result);
+		}
+
+		return total;
+	}
+
+	// Writes all of the bytes starting at the specified offset.
+	inline void WriteAt(const uint64_t offset, const std::span<const unsigned char> bytes) const
+	{
+#if _WIN32
+		if (_lseeki64(fd, static_cast<long long>(offset), SEEK_SET) < 0)
+			ThrowLastError("The file could not be written.");
+#endif
+
+		size_t total = 0;
+
+		while (total < bytes.size())
+		{
+#if _WIN32
+			const int result = _write(fd, bytes.data() + total, static_cast<unsigned int>(std::min<size_t>(bytes.size() - total, INT_MAX)));
+#else
+			const ssize_t result = pwrite(fd, bytes.data() + total, bytes.size() - total, static_cast<off_t>(offset + total));
+#endif
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				ThrowLastError("The file could not be written.");
+			}
+
+			total += static_cast<size_t>(result);
+		}
+	}
+
+	inline void Close() noexcept
+	{
+		if (fd < 0)
+			return;
+
+#if _WIN32
+		_close(fd);
+#else
+		close(fd);
+#endif
+		fd = -1;
+	}
+
+	// Reserves disk space for the specified range without changing the size of the file, so that running out of space is
+	// reported before anything is written and the file ends up in as few extents as possible. Does nothing where that's
+	// not supported (e.g. on Windows or file systems without fallocate).
+	inline void Preallocate(const uint64_t offset, const uint64_t length) const
+	{
+#if defined(__linux__)
+		if (length == 0)
+			return;
+
+		while (fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length)) != 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (IsUnsupportedError(errno))
+				return;
+
+			ThrowLastError("The disk space for the file could not be reserved.");
+		}
+#endif
+	}
+
+	// Flushes everything written to the file, through any descriptor, to the disk.
+	inline void Sync() const
+	{
+#if _WIN32
+		if (_commit(fd) != 0)
+#else
+		if (fsync(fd) != 0)
+#endif
+			ThrowLastError("The file could not be flushed to the disk.");
+	}
+
+	// Copies bytes between (or within) files without passing them through user space, using copy_file_range or, where
+	// that's not supported (e.g. across file systems on older kernels), sendfile. Returns the number of bytes copied,
+	// which is less than the requested length if the platform or the file system supports neither.
+	static inline uint64_t CopyRange(const NativeFile& source, const uint64_t sourceOffset,
+		const NativeFile& dest, const uint64_t destOffset, const uint64_t length)
+	{
+#if defined(__linux__)
+		loff_t in = static_cast<loff_t>(sourceOffset), out = static_cast<loff_t>(destOffset);
+		uint64_t copied = 0;
+
+		while (copied < length)
+		{
+			// The kernel copies (or reflinks) at most ~2 GiB per call
+			const ssize_t result = copy_file_range(source.fd, &in, dest.fd, &out, static_cast<size_t>(length - copied), 0u);
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (IsUnsupportedError(errno))
+					return copied + SendRange(source, static_cast<uint64_t>(in), dest, static_cast<uint64_t>(out), length - copied);
+
+				ThrowLastError("The kernel failed to copy the file range.");
+			}
+
+			if (result == 0)  // Source EOF
+				break;
+
+			copied += static_cast<uint64_t>(result);
+		}
+
+		return copied;
+#else
+		// FSCTL_DUPLICATE_EXTENTS_TO_FILE only works on ReFS - not worth it for now
+		return UINT64_C(0);
+#endif
+	}
+};
\ No newline at end of file
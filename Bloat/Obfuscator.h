@@ -1,17 +1,39 @@
 #pragma once
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <span>
 #include <vector>
 #include "Exceptions.h"
+#include "Parallel.h"
 #include "Xorshift64Star.h"
+#include "XorKernel.h"
 
 enum class ObfuscatorId : uint8_t
 {
-	EmptyObfuscator = 0ui8, RandomXorObfuscator = 1ui8
+	EmptyObfuscator = UINT8_C(0), RandomXorObfuscator = UINT8_C(1)
+};
+
+// Applies an obfuscator to a single file chunk by chunk. Chunks must be passed in the same order they appear in the file.
+class ObfuscationCursor
+{
+public:
+	inline void Apply(const std::span<unsigned char> bytes) { Apply(bytes, bytes); }
+
+	// Writes the obfuscated source bytes to the destination in a single pass. Both must be of the same size, and the
+	// destination may be the source itself.
+	virtual void Apply(std::span<const unsigned char> source, std::span<unsigned char> destination) = 0;
+
+	// Moves the cursor to the specified byte offset of the file.
+	virtual void Seek(const uint64_t offset) = 0;
+	inline virtual ~ObfuscationCursor() = default;
 };
 
 class Obfuscator
 {
 protected:
-	uint64_t key = 0ui64;
+	uint64_t key = UINT64_C(0);
 
 public:
 	inline virtual ObfuscatorId GetId() const noexcept = 0;
@@ -27,12 +49,40 @@ public:
 	virtual void Obfuscate(std::vector<unsigned char>& bytes) const = 0;
 	virtual void Deobfuscate(std::vector<unsigned char>& bytes) const = 0;
 
+	// Obfuscation is symmetric, so the same cursor both obfuscates and deobfuscates.
+	virtual std::unique_ptr<ObfuscationCursor> CreateCursor() const = 0;
+
+	// Obfuscates (or deobfuscates) bytes located at the specified offset of a file, independently of the rest of it.
+	inline void ObfuscateAt(const std::span<unsigned char> bytes, const uint64_t offset) const
+	{
+		const auto cursor = CreateCursor();
+
+		cursor->Seek(offset);
+		cursor->Apply(bytes);
+	}
+
 	inline virtual std::unique_ptr<Obfuscator> Clone() const = 0;
 	inline virtual ~Obfuscator() = default;
 };
 
 class EmptyObfuscator : public Obfuscator
 {
+private:
+	class Cursor : public ObfuscationCursor
+	{
+	public:
+		using ObfuscationCursor::Apply;
+
+		inline void Apply(const std::span<const unsigned char> source, const std::span<unsigned char> destination) override
+		{
+			// Preserve the original bytes
+			if (source.data() != destination.data())
+				std::memcpy(destination.data(), source.data(), source.size());
+		}
+
+		inline void Seek(const uint64_t) override { }
+	};
+
 public:
 	inline ObfuscatorId GetId() const noexcept override { return ObfuscatorId::EmptyObfuscator; }
 	inline const char* GetName() const noexcept override { return "Empty obfuscator"; }
@@ -59,6 +109,11 @@ public:
 		// Preserve the original bytes
 	}
 
+	inline std::unique_ptr<ObfuscationCursor> CreateCursor() const override
+	{
+		return std::make_unique<Cursor>();
+	}
+
 	inline virtual std::unique_ptr<Obfuscator> Clone() const override
 	{
 		return std::make_unique<EmptyObfuscator>();
@@ -67,6 +122,87 @@ public:
 
 class RandomXorObfuscator : public Obfuscator
 {
+private:
+	class Cursor : public ObfuscationCursor
+	{
+	private:
+		const uint64_t key;
+
+		// Xorshift is much faster than mt19937 and eliminates patterns as efficiently
+		Xorshift64Star random;
+
+		uint64_t lastNumber{};
+		int usedBytes = 8;  // How many bytes of lastNumber have already been consumed by previous chunks
+
+		static constexpr inline const size_t KEYSTREAM_BLOCK_SIZE = 512;  // In numbers (4 KiB)
+
+		static inline uint64_t ToBigEndian(const uint64_t value) noexcept
+		{
+			if constexpr (std::endian::native == std::endian::little)
+				return std::byteswap(value);  // A single bswap/movbe instruction
+			else
+				return value;
+		}
+
+	public:
+		inline explicit Cursor(const uint64_t key) noexcept : key(key), random(key) { }
+
+		inline void Seek(const uint64_t offset) override
+		{
+			// Every number covers 8 bytes, so jump straight to the one the offset falls into
+			random = Xorshift64Star(key);
+			random.Jump(offset / 8);
+
+			usedBytes = static_cast<int>(offset % 8);
+
+			if (usedBytes != 0)
+				lastNumber = random.NextUInt64();
+			else
+				usedBytes = 8;
+		}
+
+		using ObfuscationCursor::Apply;
+
+		void Apply(const std::span<const unsigned char> source, const std::span<unsigned char> destination) override
+		{
+			const size_t byteSize = source.size();
+			size_t i = 0;
+
+			// Use up whatever the previous chunk left of the last number
+			for (; usedBytes < 8 && i < byteSize; i++, usedBytes++)
+				destination[i] = source[i] ^ ((lastNumber >> ((7 - usedBytes) * 8)) & 0xFF);
+
+			// Generate the numbers a block at a time and XOR the whole block using vector instructions. Numbers are
+			// stored big-endian so that their most significant byte lines up with the first byte, i.e.
+			//     bytes[i]     ^= r >> (7 * 8);
+			//     bytes[i + 1] ^= r >> (6 * 8);
+			//     ...
+			//     bytes[i + 7] ^= r >> (0 * 8);
+			alignas(64) uint64_t keystream[KEYSTREAM_BLOCK_SIZE];
+
+			while (byteSize - i >= 8)
+			{
+				const size_t numWords = std::min((byteSize - i) / 8, KEYSTREAM_BLOCK_SIZE);
+
+				for (size_t j = 0; j < numWords; j++)
+					keystream[j] = ToBigEndian(random.NextUInt64());
+
+				XorKernel::Apply(source.subspan(i, numWords * 8), destination.data() + i, reinterpret_cast<const unsigned char*>(keystream));
+				i += numWords * 8;
+			}
+
+			if (i < byteSize)  // Handle leftover bytes and keep the rest of the number for the next chunk
+			{
+				lastNumber = random.NextUInt64();
+
+				for (usedBytes = 0; i < byteSize; i++, usedBytes++)
+					destination[i] = source[i] ^ ((lastNumber >> ((7 - usedBytes) * 8)) & 0xFF);
+			}
+		}
+	};
+
+	static constexpr inline const size_t PARALLEL_SEGMENT_SIZE = 16 * 1024 * 1024;
+
 public:
 	inline ObfuscatorId GetId() const noexcept override { return ObfuscatorId::RandomXorObfuscator; }
 	inline const char* GetName() const noexcept override { return "Random XOR obfuscator"; }
@@ -77,49 +213,28 @@ public:
 
 	inline void SetKey(const uint64_t key) override
 	{
-		if (key == 0ui64)
+		if (key == UINT64_C(0))
 			throw std::invalid_argument("This obfuscator cannot use zero as its key.");
 
 		this->key = key;
 	}
 
-	void Obfuscate(std::vector<unsigned char>& bytes) const override
+	inline void Obfuscate(std::vector<unsigned char>& bytes) const override
 	{
-		if (key == 0ui64)
-			throw std::invalid_argument("This obfuscator cannot use zero as its key.");
-
-		// Xorshift is much faster than mt19937 and eliminates patterns as efficiently
-		Xorshift64Star random(key);
-
-		const size_t byteSize = bytes.size();
-		size_t i;
+		const size_t numSegments = (bytes.size() + PARALLEL_SEGMENT_SIZE - 1) / PARALLEL_SEGMENT_SIZE;
 
-		for (i = 0; i + 7 < byteSize; i += 8)
+		if (numSegments <= 1)
 		{
-			const uint64_t r = random.NextUInt64();
-
-			for (int j = 0; j < 8; j++)
-				bytes[i + j] ^= (r >> ((7 - j) * 8)) & 0xFF;
-
-			/* Equivalent to:
-				bytes[i]	 ^= r >> (7 * 8);
-				bytes[i + 1] ^= r >> (6 * 8);
-				bytes[i + 2] ^= r >> (5 * 8);
-				bytes[i + 3] ^= r >> (4 * 8);
-				bytes[i + 4] ^= r >> (3 * 8);
-				bytes[i + 5] ^= r >> (2 * 8);
-				bytes[i + 6] ^= r >> (1 * 8);
-				bytes[i + 7] ^= r >> (0 * 8);
-			*/
+			CreateCursor()->Apply(bytes);
+			return;
 		}
 
-		if (i < byteSize)  // Handle leftover bytes
+		// Large buffers are split into segments, each of which jumps ahead to its own offset of the keystream
+		Parallel::For(numSegments, Parallel::GetDefaultThreadCount(), [this, &bytes](const size_t i)
 		{
-			const uint64_t r = random.NextUInt64();
-
-			for (int j = 0; i + j < byteSize; j++)
-				bytes[i + j] ^= (r >> ((7 - j) * 8)) & 0xFF;
-		}
+			const size_t offset = i * PARALLEL_SEGMENT_SIZE;
+			ObfuscateAt(std::span(bytes).subspan(offset, std::min(PARALLEL_SEGMENT_SIZE, bytes.size() - offset)), offset);
+		});
 	}
 
 	inline void Deobfuscate(std::vector<unsigned char>& bytes) const override
@@ -128,6 +243,14 @@ public:
 		Obfuscate(bytes);
 	}
 
+	inline std::unique_ptr<ObfuscationCursor> CreateCursor() const override
+	{
+		if (key == UINT64_C(0))
+			throw std::invalid_argument("This obfuscator cannot use zero as its key.");
+
+		return std::make_unique<Cursor>(key);
+	}
+
 	inline virtual std::unique_ptr<Obfuscator> Clone() const override
 	{
 		auto obfuscator = std::make_unique<RandomXorObfuscator>();
@@ -0,0 +1,121 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+// Lets producer threads scramble several files ahead while a single consumer receives their chunks in file order.
+// The amount of buffered data is capped, so memory usage stays bounded however far ahead the producers get.
+class OrderedChunkQueue
+{
+private:
+	struct Item
+	{
+		std::deque<std::vector<unsigned char>> chunks{};
+		size_t bufferedBytes = 0;
+
+		bool isComplete = false;
+		std::exception_ptr exception{};
+	};
+
+	std::mutex mutex{};
+	std::condition_variable changed{};
+
+	std::vector<Item> items;
+	size_t currentItem = 0;  // The item the consumer is waiting for
+
+	size_t bufferedBytes = 0;
+	const size_t maxBufferedBytes;
+
+	bool isAborted = false;
+
+public:
+	class AbortedException : public std::runtime_error
+	{
+	public:
+		inline explicit AbortedException() noexcept : std::runtime_error("The queue has been aborted.") { }
+	};
+
+	inline OrderedChunkQueue(const size_t itemCount, const size_t maxBufferedBytes)
+		: items(itemCount), maxBufferedBytes(maxBufferedBytes) { }
+
+	// Producer side: queues a copy of the chunk, blocking while the buffer is full. The item the consumer is waiting
+	// for may always queue a chunk once its own queue has been drained, so the consumer can never be starved.
+	inline void Push(const size_t item, const std::span<const unsigned char> chunk)
+	{
+		std::unique_lock lock(mutex);
+
+		changed.wait(lock, [&]()
+		{
+			return isAborted || bufferedBytes + chunk.size() <= maxBufferedBytes
+				|| (item == currentItem && items[item].bufferedBytes == 0);
+		});
+
+		if (isAborted)
+			throw AbortedException();
+
+		items[item].chunks.emplace_back(chunk.begin(), chunk.end());
+		items[item].bufferedBytes += chunk.size();
+		bufferedBytes += chunk.size();
+
+		changed.notify_all();
+	}
+
+	// Producer side: marks the item as complete, optionally with the exception that interrupted it.
+	inline void Complete(const size_t item, const std::exception_ptr exception = nullptr)
+	{
+		const std::scoped_lock lock(mutex);
+
+		items[item].isComplete = true;
+		items[item].exception = exception;
+
+		changed.notify_all();
+	}
+
+	// Consumer side: passes every chunk of the item to the consumer in order, returning once the item is complete.
+	// Items must be consumed in ascending order. Rethrows the exception the producer has failed with, if any.
+	template<typename Consumer>
+	inline void Consume(const size_t item, Consumer&& consume)
+	{
+		std::unique_lock lock(mutex);
+
+		currentItem = item;
+		changed.notify_all();
+
+		while (true)
+		{
+			changed.wait(lock, [&]() { return !items[item].chunks.empty() || items[item].isComplete; });
+
+			if (items[item].chunks.empty())
+				break;
+
+			std::vector<unsigned char> chunk = std::move(items[item].chunks.front());
+			items[item].chunks.pop_front();
+
+			lock.unlock();
+			consume(std::span<const unsigned char>(chunk));
+			lock.lock();
+
+			// Only release the space once the chunk is written, so the buffer size stays an actual upper bound
+			items[item].bufferedBytes -= chunk.size();
+			bufferedBytes -= chunk.size();
+
+			changed.notify_all();
+		}
+
+		if (items[item].exception)
+			std::rethrow_exception(items[item].exception);
+	}
+
+	// Wakes up and fails all blocked producers. Used when the consumer gives up.
+	inline void Abort() noexcept
+	{
+		const std::scoped_lock lock(mutex);
+
+		isAborted = true;
+		changed.notify_all();
+	}
+};
\ No newline at end of file
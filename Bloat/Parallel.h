@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Parallel
+{
+public:
+	// Gets the number of threads used when none has been specified.
+	static inline size_t GetDefaultThreadCount() noexcept
+	{
+		return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	// Invokes body(i) for every i in [0, count) on up to threadCount threads, handing out indices in ascending order.
+	// If an invocation throws, the remaining indices are skipped and the first exception is rethrown to the caller.
+	static inline void For(const size_t count, const size_t threadCount, const std::function<void(size_t)>& body)
+	{
+		const size_t numThreads = std::min(threadCount, count);
+
+		if (numThreads <= 1)
+		{
+			for (size_t i = 0; i < count; i++)
+				body(i);
+
+			return;
+		}
+
+		std::atomic<size_t> nextIndex = 0;
+		std::atomic<bool> hasFailed = false;
+
+		std::exception_ptr exception{};
+		std::mutex exceptionMutex{};
+
+		const auto& work = [&]() -> void
+		{
+			for (size_t i = nextIndex++; i < count && !hasFailed; i = nextIndex++)
+			{
+				try
+				{
+					body(i);
+				}
+				catch (...)
+				{
+					const std::scoped_lock lock(exceptionMutex);
+
+					if (!exception)
+						exception = std::current_exception();
+
+					hasFailed = true;
+				}
+			}
+		};
+
+		{
+			std::vector<std::jthread> threads{};
+			threads.reserve(numThreads - 1);
+
+			for (size_t i = 1; i < numThreads; i++)
+				threads.emplace_back(work);
+
+			work();  // The calling thread pitches in as well
+		}
+
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <span>
+#include <stdexcept>
+#include <vector>
+#include "Scrambler.h"
+
+// Converts data scrambled by one scrambler into data scrambled by another (e.g. when the obfuscator key or the bloat
+// multiplier changes) without going through a separate unscrambled copy.
+class Rescrambler
+{
+private:
+	const Scrambler& source;
+	const Scrambler& target;
+
+	// Chunks are converted a tile at a time, so the bytes are still in the cache when the new keystream is applied
+	static constexpr inline const size_t TILE_SIZE = 16 * 1024;
+
+public:
+	inline Rescrambler(const Scrambler& source, const Scrambler& target) noexcept : source(source), target(target) { }
+
+	// Produces a single target replica. The producer feeds the first replica of the source data (the only one needed)
+	// to the consumer chunk by chunk. Replicas are independent of each other, so they may be produced concurrently.
+	inline void RescrambleReplica(const uint64_t replica, const uint64_t replicaSize, const ChunkProducer& produceSourceReplica,
+		const ChunkConsumer& consume) const
+	{
+		if (replica >= target.GetBloatMultiplier())
+			throw std::out_of_range("The specified replica does not exist.");
+
+		const auto sourceCursor = source.GetObfuscator()->CreateCursor();
+		const auto targetCursor = target.GetObfuscator()->CreateCursor();
+
+		targetCursor->Seek(replica * replicaSize);
+		std::vector<unsigned char> buffer{};
+
+		produceSourceReplica([&sourceCursor, &targetCursor, &buffer, &consume](const std::span<const unsigned char> chunk)
+		{
+			buffer.resize(chunk.size());
+
+			for (size_t offset = 0; offset < chunk.size(); offset += TILE_SIZE)
+			{
+				const size_t length = std::min(TILE_SIZE, chunk.size() - offset);
+				const auto tile = std::span(buffer).subspan(offset, length);
+
+				sourceCursor->Apply(chunk.subspan(offset, length), tile);
+				targetCursor->Apply(tile);
+			}
+
+			consume(buffer);
+		});
+	}
+
+	// Produces all target replicas from a source replica held in memory, which is unscrambled only once.
+	inline void Rescramble(const std::span<const unsigned char> sourceReplica, const ChunkConsumer& consume) const
+	{
+		const uint64_t bloatMultiplier = target.GetBloatMultiplier();
+
+		if (bloatMultiplier < 1)
+			throw std::invalid_argument("The specified bloat multiplier must be greater than or equal to 1.");
+
+		std::vector<unsigned char> bytes(sourceReplica.size()), buffer(sourceReplica.size());
+		source.GetObfuscator()->CreateCursor()->Apply(sourceReplica, bytes);
+
+		const auto targetCursor = target.GetObfuscator()->CreateCursor();
+
+		for (uint64_t run = 0; run < bloatMultiplier; run++)
+		{
+			targetCursor->Apply(bytes, buffer);
+			consume(buffer);
+		}
+	}
+};
\ No newline at end of file
@@ -1,8 +1,16 @@
 #pragma once
+#include <algorithm>
+#include <functional>
+#include <span>
 #include <vector>
 #include "Bloater.h"
 #include "Obfuscator.h"
 
+using ChunkConsumer = std::function<void(std::span<const unsigned char>)>;
+
+// Feeds an entire file to the consumer chunk by chunk. May be invoked more than once.
+using ChunkProducer = std::function<void(const ChunkConsumer&)>;
+
 struct Scrambler
 {
 private:
@@ -20,7 +28,7 @@ public:
 
 	static inline std::shared_ptr<Scrambler> CreateEmpty() noexcept
 	{
-		return std::make_shared<Scrambler>(1ui64, ObfuscatorFactory::Create(ObfuscatorId::EmptyObfuscator));
+		return std::make_shared<Scrambler>(UINT64_C(1), ObfuscatorFactory::Create(ObfuscatorId::EmptyObfuscator));
 	}
 
 	inline Scrambler(uint64_t bloatMultiplier, const std::unique_ptr<Obfuscator>& obfuscator) noexcept
@@ -28,13 +36,85 @@ public:
 
 	inline void Scramble(std::vector<unsigned char>& bytes) const
 	{
-		Bloater::Bloat(bytes, bloatMultiplier);
-		obfuscator->Obfuscate(bytes);
+		if (bloatMultiplier < 1)
+			throw std::invalid_argument("The specified bloat multiplier must be greater than or equal to 1.");
+
+		const size_t originalSize = bytes.size();
+		bytes.resize(originalSize * bloatMultiplier);
+
+		// Rather than copying the replicas and obfuscating them afterwards, every replica is obfuscated straight out
+		// of the (still pristine) first one, which is obfuscated in place last. Each byte is written exactly once.
+		const auto cursor = obfuscator->CreateCursor();
+		const std::span<const unsigned char> original(bytes.data(), originalSize);
+
+		for (uint64_t run = bloatMultiplier - 1; run > 0; run--)
+		{
+			cursor->Seek(run * originalSize);
+			cursor->Apply(original, std::span(bytes).subspan(run * originalSize, originalSize));
+		}
+
+		cursor->Seek(UINT64_C(0));
+		cursor->Apply(std::span(bytes).first(originalSize));
 	}
 
 	inline void Unscramble(std::vector<unsigned char>& bytes) const
 	{
-		obfuscator->Deobfuscate(bytes);
+		// Drop the extra replicas first so only the bytes that are kept need to be deobfuscated
 		Bloater::Debloat(bytes, bloatMultiplier);
+		obfuscator->Deobfuscate(bytes);
+	}
+
+	// Streaming counterpart of Scramble(). The producer is invoked once per replica, so memory usage is bounded
+	// by the chunk size regardless of the file size or the bloat multiplier. Every chunk is obfuscated on its way
+	// into the output buffer, so it's only read and written once.
+	inline void Scramble(const ChunkProducer& produce, const ChunkConsumer& consume) const
+	{
+		if (bloatMultiplier < 1)
+			throw std::invalid_argument("The specified bloat multiplier must be greater than or equal to 1.");
+
+		const auto cursor = obfuscator->CreateCursor();
+		std::vector<unsigned char> buffer{};
+
+		for (uint64_t run = 0; run < bloatMultiplier; run++)
+		{
+			produce([&cursor, &buffer, &consume](const std::span<const unsigned char> chunk)
+			{
+				buffer.resize(chunk.size());
+				cursor->Apply(chunk, buffer);
+
+				consume(buffer);
+			});
+		}
+	}
+
+	// Streaming counterpart of Unscramble(). Only the first replica is passed to the consumer, so the producer doesn't
+	// need to supply anything past it (the rest is ignored anyway).
+	inline void Unscramble(const ChunkProducer& produce, const uint64_t scrambledSize, const ChunkConsumer& consume) const
+	{
+		if (bloatMultiplier < 1)
+			throw std::invalid_argument("The specified bloat multiplier is invalid.");
+
+		if (scrambledSize % bloatMultiplier != 0)
+			throw std::invalid_argument("The passed bytes cannot be debloated. The data is either corrupted or was bloated using a different bloat multiplier.");
+
+		const uint64_t unscrambledSize = scrambledSize / bloatMultiplier;
+		uint64_t position = 0;
+
+		const auto cursor = obfuscator->CreateCursor();
+		std::vector<unsigned char> buffer{};
+
+		produce([&](const std::span<const unsigned char> chunk)
+		{
+			if (position >= unscrambledSize)
+				return;  // The remaining replicas are discarded, just like Bloater::Debloat() does
+
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(chunk.size(), unscrambledSize - position));
+
+			buffer.resize(length);
+			cursor->Apply(chunk.first(length), buffer);
+
+			consume(buffer);
+			position += length;
+		});
 	}
 };
@@ -1,14 +1,78 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
 
 class SplitMix64
 {
 public:
+    // Computes the same hash as ComputeHash(), but over bytes that are supplied chunk by chunk.
+    class Hasher
+    {
+    private:
+        uint64_t hash = UINT64_C(0x9e3779b97f4a7c15);
+
+        unsigned char pending[8]{};  // Bytes that haven't formed a whole 8-byte word yet
+        size_t pendingSize = 0;
+
+    public:
+        inline void Update(const std::span<const unsigned char> bytes) noexcept
+        {
+            const size_t byteSize = bytes.size();
+            size_t i = 0;
+
+            if (pendingSize > 0)  // Complete the word left over from the previous chunk
+            {
+                i = std::min(8 - pendingSize, byteSize);
+
+                std::memcpy(pending + pendingSize, bytes.data(), i);
+                pendingSize += i;
+
+                if (pendingSize == 8)
+                {
+                    uint64_t buffer;
+                    std::memcpy(&buffer, pending, 8);
+
+                    hash += Mix(buffer);
+                    pendingSize = 0;
+                }
+            }
+
+            for (; i + 8 <= byteSize; i += 8)
+            {
+                uint64_t buffer;
+                std::memcpy(&buffer, &bytes[i], 8);
+
+                hash += Mix(buffer);
+            }
+
+            if (i < byteSize)  // Fewer than 8 bytes are left, as pendingSize is 0 by now
+            {
+                pendingSize = byteSize - i;
+                std::memcpy(pending, &bytes[i], pendingSize);
+            }
+        }
+
+        inline uint64_t GetHash() const noexcept
+        {
+            if (pendingSize == 0)
+                return hash;
+
+            uint64_t buffer = UINT64_C(0);
+            std::memcpy(&buffer, pending, pendingSize);
+
+            return hash + Mix(buffer);
+        }
+    };
+
     static inline uint64_t Mix(uint64_t x) noexcept
     {
         x ^= x >> 30;
-        x *= 0xbf58476d1ce4e5b9ui64;
+        x *= UINT64_C(0xbf58476d1ce4e5b9);
         x ^= x >> 27;
-        x *= 0x94d049bb133111ebui64;
+        x *= UINT64_C(0x94d049bb133111eb);
         x ^= x >> 31;
 
         return x;
@@ -24,7 +88,7 @@ public:
 
         const uint64_t byteSize = bytes.size();
 
-        uint64_t hash = 0x9e3779b97f4a7c15ui64;  // Cool golden ratio constant
+        uint64_t hash = UINT64_C(0x9e3779b97f4a7c15);  // Cool golden ratio constant
         uint64_t i;
 
         for (i = 0; i + 8 <= byteSize; i += 8)
@@ -37,7 +101,7 @@ public:
 
         if (i < byteSize)  // Handle the tail
         {
-            uint64_t buffer = 0ui64;
+            uint64_t buffer = UINT64_C(0);
             std::memcpy(&buffer, &bytes[i], byteSize - i);
 
             hash += Mix(buffer);
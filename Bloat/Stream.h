@@ -1,8 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 #include <iostream>
+#include "IoRing.h"
+#include "NativeFile.h"
 
 namespace fs = std::filesystem;
 
@@ -13,6 +22,9 @@ protected:
 	StreamType stream;
 
 public:
+	// Large files are processed in chunks of this size, keeping memory usage flat regardless of file size
+	static constexpr inline const size_t CHUNK_SIZE = 1024 * 1024;
+
 	inline explicit Stream(StreamType&& stream) : stream(std::move(stream)) { }
 
 	inline StreamType& GetStream() noexcept { return stream; }
@@ -27,6 +39,11 @@ public:
 	inline std::streampos GetReadPosition() noexcept { return stream.tellg(); }
 	inline void SetReadPosition(const std::streampos position) noexcept { stream.seekg(position); }
 
+	inline std::streampos GetWritePosition() { return stream.tellp(); }
+	inline void SetWritePosition(const std::streampos position) { stream.seekp(position); }
+
+	inline void Flush() { stream.flush(); }
+
 	template<typename T>
 	inline T Read()
 	{
@@ -44,6 +61,28 @@ public:
 		return bytes;
 	}
 
+	inline void ReadBytes(const std::span<unsigned char> buffer)
+	{
+		stream.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+	}
+
+	// Reads the specified number of bytes chunk by chunk, passing every chunk to the consumer.
+	template<typename Consumer>
+	inline void ReadChunks(uint64_t numBytes, Consumer&& consume, const size_t chunkSize = CHUNK_SIZE)
+	{
+		std::vector<unsigned char> buffer(static_cast<size_t>(std::min<uint64_t>(numBytes, chunkSize)));
+
+		while (numBytes > 0)
+		{
+			const auto chunk = std::span(buffer).first(static_cast<size_t>(std::min<uint64_t>(numBytes, chunkSize)));
+
+			ReadBytes(chunk);
+			consume(std::span<const unsigned char>(chunk));
+
+			numBytes -= chunk.size();
+		}
+	}
+
 	inline std::vector<unsigned char> ReadAllBytes()
 	{
 		stream.seekg(0, std::ios::end);
@@ -81,45 +120,449 @@ public:
 		stream.write(reinterpret_cast<const char*>(value.data()), value.length());
 	}
 
+	inline void Write(const std::u8string_view value)
+	{
+		stream.write(reinterpret_cast<const char*>(value.data()), value.length());
+	}
+
 	inline void Write(const std::vector<unsigned char>& bytes)
 	{
 		stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
 	}
+
+	inline void WriteBytes(const std::span<const unsigned char> bytes)
+	{
+		stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	}
 };
 
-// std::fstream if it were actually good:
-class FileStream : public Stream<std::fstream>
+// A file descriptor with a buffer of its own, read and written with pread/pwrite at the stream position. Implements the
+// part of the std::fstream interface Stream uses, hence the names.
+class BufferedFile
 {
+private:
+	struct AlignedDeleter
+	{
+		inline void operator()(unsigned char* buffer) const noexcept { ::operator delete[](buffer, std::align_val_t(BUFFER_ALIGNMENT)); }
+	};
+
+	using AlignedBuffer = std::unique_ptr<unsigned char[], AlignedDeleter>;
+
+	// A read or write in flight through an IoRing, along with its own copy of the data
+	struct AsyncTransfer
+	{
+		IoRequest request{};
+		AlignedBuffer buffer{};
+		size_t capacity = 0;
+
+		uint64_t offset = 0;
+		size_t length = 0;  // Zero once the transfer has been completed
+	};
+
+	NativeFile file;
+
+	AlignedBuffer buffer{};  // Allocated on first use
+	size_t bufferSize;
+
+	// Large writes in flight, if asynchronous I/O is enabled. Each of them is completed before its slot is reused or
+	// before anything else touches the file (see flush()).
+	IoRing* ring = nullptr;
+	std::vector<AsyncTransfer> asyncWrites{};
+	size_t nextAsyncWrite = 0;
+
+	uint64_t position = 0;
+	uint64_t bufferOffset = 0;  // Where the buffered bytes belong in the file
+	size_t readLength = 0;      // The number of bytes read ahead into the buffer
+	size_t writeLength = 0;     // The number of bytes in the buffer waiting to be written
+
+	static inline AlignedBuffer AllocateBuffer(const size_t size)
+	{
+		return AlignedBuffer(static_cast<unsigned char*>(::operator new[](size, std::align_val_t(BUFFER_ALIGNMENT))));
+	}
+
+	inline unsigned char* GetBuffer()
+	{
+		if (!buffer)
+			buffer = AllocateBuffer(bufferSize);
+
+		return buffer.get();
+	}
+
+	// Makes sure the buffer of the transfer can hold the specified number of bytes, reusing it if possible.
+	static inline void PrepareTransfer(AsyncTransfer& transfer, const size_t length)
+	{
+		if (transfer.capacity < length)
+		{
+			transfer.buffer = AllocateBuffer(length);
+			transfer.capacity = length;
+		}
+
+		transfer.length = length;
+	}
+
+	// Waits for the transfer and finishes it synchronously if the kernel has only done part of it, returning the number
+	// of bytes transferred.
+	inline size_t CompleteTransfer(IoRing& ring, AsyncTransfer& transfer, const bool isWrite)
+	{
+		if (transfer.length == 0)
+			return 0;
+
+		ring.Wait(transfer.request);
+		const size_t length = std::exchange(transfer.length, 0);
+
+		if (transfer.request.result < 0)
+		{
+			throw fs::filesystem_error(isWrite ? "The file could not be written." : "The file could not be read.",
+				std::error_code(-transfer.request.result, std::generic_category()));
+		}
+
+		const size_t done = static_cast<size_t>(transfer.request.result);
+
+		if (done == length)
+			return done;
+
+		const auto rest = std::span(transfer.buffer.get() + done, length - done);
+
+		if (isWrite)
+		{
+			file.WriteAt(transfer.offset + done, rest);
+			return length;
+		}
+
+		return done + file.ReadAt(transfer.offset + done, rest);
+	}
+
+	// Waits for all transfers without reporting any errors. If even waiting fails, the buffers are leaked as the kernel
+	// might still be using them.
+	static inline void AbandonTransfers(IoRing* ring, std::vector<AsyncTransfer>& transfers) noexcept
+	{
+		for (AsyncTransfer& transfer : transfers)
+		{
+			if (transfer.length == 0)
+				continue;
+
+			try
+			{
+				ring->Wait(transfer.request);
+				transfer.length = 0;
+			}
+			catch (...)
+			{
+				for (AsyncTransfer& leaked : transfers)
+					static_cast<void>(leaked.buffer.release());
+
+				break;
+			}
+		}
+	}
+
+	inline void WriteAsync(const std::span<const unsigned char> bytes)
+	{
+		if (asyncWrites.empty())
+			asyncWrites.resize(ASYNC_QUEUE_DEPTH);
+
+		AsyncTransfer& transfer = asyncWrites[nextAsyncWrite];
+		nextAsyncWrite = (nextAsyncWrite + 1) % asyncWrites.size();
+
+		CompleteTransfer(*ring, transfer, true);  // Whatever used the slot before
+		PrepareTransfer(transfer, bytes.size());
+
+		std::memcpy(transfer.buffer.get(), bytes.data(), bytes.size());
+		transfer.offset = position;
+
+		ring->SubmitWrite(file.GetDescriptor(), position, std::span(transfer.buffer.get(), bytes.size()), transfer.request);
+	}
+
+	[[noreturn]] static inline void ThrowEndOfFile()
+	{
+		throw std::ios_base::failure("Attempted to read past the end of the file.");
+	}
+
 public:
-	inline static FileStream OpenRead(const fs::path& path)
+	static constexpr inline const size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+	static constexpr inline const size_t BUFFER_ALIGNMENT = 4096;
+
+	// Reads of at least this many bytes go straight to the destination, only smaller ones (e.g. header fields) go through
+	// the buffer
+	static constexpr inline const size_t DIRECT_READ_SIZE = 4096;
+
+	// How much small reads fill the buffer with. Kept small since seeking past the buffer (e.g. skipping file data)
+	// throws the rest of it away.
+	static constexpr inline const size_t READ_AHEAD_SIZE = 64 * 1024;
+
+	// How many reads (see ReadChunks()) or writes a stream keeps in flight when asynchronous I/O is enabled
+	static constexpr inline const size_t ASYNC_QUEUE_DEPTH = 4;
+
+	inline explicit BufferedFile(NativeFile&& file, const size_t bufferSize) : file(std::move(file)), bufferSize(bufferSize)
 	{
-		std::fstream stream;
+		if (bufferSize == 0)
+			throw std::invalid_argument("The buffer size must be greater than zero.");
+	}
 
-		stream.exceptions(std::ios::badbit | std::ios::failbit);
-		stream.open(path, std::ios::in | std::ios::binary);
+	inline BufferedFile(BufferedFile&& other) noexcept
+		: file(std::move(other.file)), buffer(std::move(other.buffer)), bufferSize(other.bufferSize), ring(other.ring),
+		asyncWrites(std::move(other.asyncWrites)), nextAsyncWrite(other.nextAsyncWrite), position(other.position),
+		bufferOffset(other.bufferOffset), readLength(std::exchange(other.readLength, 0)), writeLength(std::exchange(other.writeLength, 0)) { }
+
+	inline BufferedFile& operator=(BufferedFile&& other)
+	{
+		if (this != &other)
+		{
+			close();
 
-		return FileStream(std::move(stream));
+			file = std::move(other.file);
+			buffer = std::move(other.buffer);
+			bufferSize = other.bufferSize;
+			ring = other.ring;
+			asyncWrites = std::move(other.asyncWrites);
+			nextAsyncWrite = other.nextAsyncWrite;
+			position = other.position;
+			bufferOffset = other.bufferOffset;
+			readLength = std::exchange(other.readLength, 0);
+			writeLength = std::exchange(other.writeLength, 0);
+		}
+
+		return *this;
 	}
 
-	inline static FileStream OpenWrite(const fs::path& path, const bool overwrite)
+	inline ~BufferedFile()
 	{
-		std::fstream stream;
+		try
+		{
+			flush();
+		}
+		catch (...) { /* Just like std::fstream, there's no way to report it from here. Close() explicitly to find out. */ }
 
-		stream.exceptions(std::ios::badbit | std::ios::failbit);
-		stream.open(path, std::ios::out | std::ios::binary | (overwrite ? std::ios::trunc : 0));
+		Abandon();  // Waits for whatever is still in flight if flushing has failed
+	}
+
+	inline const NativeFile& GetFile() const noexcept { return file; }
+
+	inline void read(char* data, const std::streamsize count)
+	{
+		flush();
+
+		auto destination = std::span(reinterpret_cast<unsigned char*>(data), static_cast<size_t>(count));
+
+		if (position >= bufferOffset && position - bufferOffset < readLength)  // Whatever has been read ahead already
+		{
+			const size_t offset = static_cast<size_t>(position - bufferOffset);
+			const size_t length = std::min(destination.size(), readLength - offset);
+
+			std::memcpy(destination.data(), buffer.get() + offset, length);
+
+			destination = destination.subspan(length);
+			position += length;
+		}
+
+		if (destination.empty())
+			return;
+
+		if (destination.size() >= DIRECT_READ_SIZE || destination.size() >= bufferSize)
+		{
+			if (file.ReadAt(position, destination) != destination.size())
+				ThrowEndOfFile();
+
+			position += destination.size();
+			return;
+		}
+
+		bufferOffset = position;
+		readLength = file.ReadAt(position, std::span(GetBuffer(), std::min(bufferSize, READ_AHEAD_SIZE)));
+
+		if (readLength < destination.size())
+			ThrowEndOfFile();
 
-		static char buffer[65536];
-		stream.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+		std::memcpy(destination.data(), buffer.get(), destination.size());
+		position += destination.size();
+	}
+
+	inline void write(const char* data, const std::streamsize count)
+	{
+		const auto bytes = std::span(reinterpret_cast<const unsigned char*>(data), static_cast<size_t>(count));
+		readLength = 0;  // What has been read ahead might be overwritten
+
+		// Writes are only gathered while they're contiguous and fit into the buffer
+		if (writeLength != 0 && (position != bufferOffset + writeLength || writeLength + bytes.size() > bufferSize))
+			flush();
+
+		if (bytes.size() >= bufferSize)
+		{
+			if (ring == nullptr)
+				ring = IoRing::GetForThisThread();
+
+			if (ring != nullptr)
+				WriteAsync(bytes);
+			else
+				file.WriteAt(position, bytes);
+
+			position += bytes.size();
+			return;
+		}
+
+		if (writeLength == 0)
+			bufferOffset = position;
+
+		std::memcpy(GetBuffer() + writeLength, bytes.data(), bytes.size());
+
+		writeLength += bytes.size();
+		position += bytes.size();
+	}
+
+	// Writes whatever is buffered and waits for the writes in flight.
+	inline void flush()
+	{
+		if (writeLength != 0)
+		{
+			file.WriteAt(bufferOffset, std::span(buffer.get(), writeLength));
+			writeLength = 0;
+		}
+
+		for (AsyncTransfer& transfer : asyncWrites)
+			CompleteTransfer(*ring, transfer, true);
+	}
+
+	// Reads the specified number of bytes chunk by chunk, keeping up to ASYNC_QUEUE_DEPTH chunks in flight through the
+	// ring while the consumer processes the current one.
+	template<typename Consumer>
+	inline void ReadChunksAsync(IoRing& ring, const uint64_t numBytes, Consumer&& consume, const size_t chunkSize)
+	{
+		flush();
+
+		const uint64_t chunkCount = (numBytes + chunkSize - 1) / chunkSize;
+		std::vector<AsyncTransfer> reads(static_cast<size_t>(std::min<uint64_t>(chunkCount, ASYNC_QUEUE_DEPTH)));
+
+		uint64_t submitted = 0, consumed = 0;
+
+		const auto& submit = [&](AsyncTransfer& read)
+		{
+			PrepareTransfer(read, static_cast<size_t>(std::min<uint64_t>(numBytes - submitted, chunkSize)));
+			read.offset = position + submitted;
+
+			ring.SubmitRead(file.GetDescriptor(), read.offset, std::span(read.buffer.get(), read.length), read.request);
+			submitted += read.length;
+		};
+
+		try
+		{
+			for (AsyncTransfer& read : reads)
+				submit(read);
+
+			for (size_t i = 0; consumed < numBytes; i = (i + 1) % reads.size())
+			{
+				const size_t expected = reads[i].length;
 
-		return FileStream(std::move(stream));
+				if (CompleteTransfer(ring, reads[i], false) != expected)
+					ThrowEndOfFile();
+
+				consume(std::span<const unsigned char>(reads[i].buffer.get(), expected));
+				consumed += expected;
+
+				if (submitted < numBytes)
+					submit(reads[i]);
+			}
+		}
+		catch (...)
+		{
+			AbandonTransfers(&ring, reads);
+			throw;
+		}
+
+		position += numBytes;
+	}
+
+	inline std::streampos tellg() const noexcept { return static_cast<std::streamoff>(position); }
+	inline std::streampos tellp() const noexcept { return static_cast<std::streamoff>(position); }
+
+	inline void seekg(const std::streampos position) noexcept { this->position = static_cast<uint64_t>(static_cast<std::streamoff>(position)); }
+	inline void seekp(const std::streampos position) noexcept { seekg(position); }
+
+	inline void seekg(const std::streamoff offset, const std::ios::seekdir direction)
+	{
+		const uint64_t origin = direction == std::ios::beg ? UINT64_C(0) : direction == std::ios::cur ? position : std::max(file.GetSize(), bufferOffset + writeLength);
+		position = static_cast<uint64_t>(static_cast<std::streamoff>(origin) + offset);
 	}
 
-	FileStream(std::fstream&& stream) : Stream<std::fstream>(std::move(stream)) { }
+	inline bool is_open() const noexcept { return file.IsOpen(); }
 
-	inline void Close() noexcept
+	inline void close()
 	{
-		if (stream.is_open())
-			stream.close();
+		if (!file.IsOpen())
+			return;
+
+		try
+		{
+			flush();
+		}
+		catch (...)
+		{
+			Abandon();
+			throw;
+		}
+
+		file.Close();
+	}
+
+	// Closes the file, dropping whatever hasn't been written yet.
+	inline void Abandon() noexcept
+	{
+		readLength = writeLength = 0;
+
+		if (ring != nullptr)
+			AbandonTransfers(ring, asyncWrites);
+
+		file.Close();
+	}
+};
+
+// std::fstream if it were actually good:
+class FileStream : public Stream<BufferedFile>
+{
+public:
+	inline static FileStream OpenRead(const fs::path& path, const size_t bufferSize = BufferedFile::DEFAULT_BUFFER_SIZE)
+	{
+		return FileStream(BufferedFile(NativeFile::OpenRead(path), bufferSize));
+	}
+
+	inline static FileStream OpenWrite(const fs::path& path, const bool overwrite, const size_t bufferSize = BufferedFile::DEFAULT_BUFFER_SIZE)
+	{
+		return FileStream(BufferedFile(NativeFile::OpenWrite(path, overwrite), bufferSize));
+	}
+
+	// Opens an existing file for both reading and writing without truncating it.
+	inline static FileStream OpenReadWrite(const fs::path& path, const size_t bufferSize = BufferedFile::DEFAULT_BUFFER_SIZE)
+	{
+		return FileStream(BufferedFile(NativeFile::OpenReadWrite(path), bufferSize));
+	}
+
+	FileStream(BufferedFile&& stream) : Stream<BufferedFile>(std::move(stream)) { }
+
+	// The descriptor behind the stream, e.g. for kernel copies. Flush() before using it.
+	inline const NativeFile& GetFile() const noexcept { return stream.GetFile(); }
+
+	// Like Stream::ReadChunks(), but reads ahead asynchronously if the thread has an IoRing.
+	template<typename Consumer>
+	inline void ReadChunks(const uint64_t numBytes, Consumer&& consume, const size_t chunkSize = CHUNK_SIZE)
+	{
+		IoRing* ring = IoRing::GetForThisThread();
+
+		if (ring != nullptr && numBytes > chunkSize)
+			stream.ReadChunksAsync(*ring, numBytes, consume, chunkSize);
+		else
+			Stream<BufferedFile>::ReadChunks(numBytes, consume, chunkSize);
+	}
+
+	// Writes whatever is still buffered and closes the file. Unlike the destructor, reports errors.
+	inline void Close()
+	{
+		stream.close();
+	}
+
+	// Closes the file without writing whatever is still buffered. For when the file is going to be deleted anyway, as
+	// a failed write of the buffer shouldn't get in the way.
+	inline void Abandon() noexcept
+	{
+		stream.Abandon();
 	}
 };
 
@@ -141,3 +584,53 @@ public:
 		fs.Close();
 	}
 };
+
+
+// Reads values out of an in-memory buffer, e.g. a block of the archive read in one go.
+class BufferReader
+{
+private:
+	std::span<const unsigned char> buffer;
+	size_t position = 0;
+
+	inline std::span<const unsigned char> Take(const size_t numBytes)
+	{
+		if (numBytes > buffer.size() - position)
+			throw std::out_of_range("Attempted to read past the end of the buffer.");
+
+		const auto bytes = buffer.subspan(position, numBytes);
+		position += numBytes;
+
+		return bytes;
+	}
+
+public:
+	inline explicit BufferReader(const std::span<const unsigned char> buffer) noexcept : buffer(buffer) { }
+
+	inline size_t GetPosition() const noexcept { return position; }
+	inline bool IsAtEnd() const noexcept { return position == buffer.size(); }
+
+	template<typename T>
+	inline T Read()
+	{
+		T value{};
+		std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+
+		return value;
+	}
+
+	inline std::string ReadString(const uint64_t numBytes)
+	{
+		const auto bytes = ReadBytes(numBytes);
+		return std::string(bytes.begin(), bytes.end());
+	}
+
+	// Gets a view of the next bytes instead of copying them.
+	inline std::span<const unsigned char> ReadBytes(const uint64_t numBytes)
+	{
+		if (numBytes > buffer.size() - position)
+			throw std::out_of_range("Attempted to read past the end of the buffer.");
+
+		return Take(static_cast<size_t>(numBytes));
+	}
+};
\ No newline at end of file
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOAT_XOR_KERNEL_SSE2 1
+#include <immintrin.h>
+#endif
+
+// XORs data with a keystream using the widest vector instructions the build targets (AVX-512, AVX2 or SSE2).
+class XorKernel
+{
+public:
+	// XORs the bytes with a keystream of the same length.
+	static inline void Apply(const std::span<unsigned char> bytes, const unsigned char* keystream) noexcept
+	{
+		Apply(bytes, bytes.data(), keystream);
+	}
+
+	// Writes the source bytes XOR'ed with a keystream of the same length to the destination in a single pass.
+	// The source may be the destination itself.
+	static inline void Apply(const std::span<const unsigned char> source, unsigned char* destination, const unsigned char* keystream) noexcept
+	{
+		const unsigned char* data = source.data();
+
+		const size_t size = source.size();
+		size_t i = 0;
+
+#if defined(__AVX512F__)
+		for (; i + 64 <= size; i += 64)
+		{
+			const __m512i d = _mm512_loadu_si512(data + i);
+			const __m512i k = _mm512_loadu_si512(keystream + i);
+
+			_mm512_storeu_si512(destination + i, _mm512_xor_si512(d, k));
+		}
+#endif
+
+#if defined(__AVX2__)
+		for (; i + 32 <= size; i += 32)
+		{
+			const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+			const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keystream + i));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_xor_si256(d, k));
+		}
+#endif
+
+#if defined(BLOAT_XOR_KERNEL_SSE2)
+		for (; i + 16 <= size; i += 16)
+		{
+			const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			const __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keystream + i));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_xor_si128(d, k));
+		}
+#endif
+
+		for (; i + 8 <= size; i += 8)  // Portable fallback (and whatever the vector loops left over)
+		{
+			uint64_t d, k;
+
+			std::memcpy(&d, data + i, 8);
+			std::memcpy(&k, keystream + i, 8);
+
+			d ^= k;
+			std::memcpy(destination + i, &d, 8);
+		}
+
+		for (; i < size; i++)
+			destination[i] = data[i] ^ keystream[i];
+	}
+};
\ No newline at end of file
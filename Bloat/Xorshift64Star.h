@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <cstdint>
 #include <random>
 
 class Xorshift64Star  // Kinda overkill but quick and deadly
@@ -9,6 +11,54 @@ private:
 
 	inline void SetState(const uint64_t state) { this->state = state != 0u ? state : DEFAULT_STATE; }
 
+	// The xorshift step is linear over GF(2), so it can be written as a 64x64 bit matrix. Column j holds the image
+	// of the state that only has bit j set.
+	using Matrix = std::array<uint64_t, 64>;
+
+	static inline uint64_t Step(uint64_t state) noexcept
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+
+		return state;
+	}
+
+	static inline uint64_t Multiply(const Matrix& matrix, uint64_t state) noexcept
+	{
+		uint64_t result = 0u;
+
+		for (int j = 0; state != 0u; j++, state >>= 1)
+		{
+			if (state & 1u)
+				result ^= matrix[j];
+		}
+
+		return result;
+	}
+
+	// Powers[k] advances the state by 2^k steps.
+	static inline const std::array<Matrix, 64>& GetJumpMatrices() noexcept
+	{
+		static const std::array<Matrix, 64> powers = []()
+		{
+			std::array<Matrix, 64> powers{};
+
+			for (int j = 0; j < 64; j++)
+				powers[0][j] = Step(uint64_t{ 1 } << j);
+
+			for (int k = 1; k < 64; k++)  // T^(2^k) = T^(2^(k-1)) * T^(2^(k-1))
+			{
+				for (int j = 0; j < 64; j++)
+					powers[k][j] = Multiply(powers[k - 1], powers[k - 1][j]);
+			}
+
+			return powers;
+		}();
+
+		return powers;
+	}
+
 public:
 	inline uint64_t GetState() const noexcept { return state; }
 
@@ -22,10 +72,19 @@ public:
 
 	inline uint64_t NextUInt64() noexcept
 	{
-		state ^= state >> 12;
-		state ^= state << 25;
-		state ^= state >> 27;
+		state = Step(state);
+		return state * UINT64_C(0x2545F4914F6CDD1D);
+	}
+
+	// Advances the generator as if NextUInt64() had been called the specified number of times, in O(log n).
+	inline void Jump(uint64_t steps) noexcept
+	{
+		const auto& powers = GetJumpMatrices();
 
-		return state * 0x2545F4914F6CDD1Dui64;
+		for (int k = 0; steps != 0u; k++, steps >>= 1)
+		{
+			if (steps & 1u)
+				state = Multiply(powers[k], state);
+		}
 	}
 };